@@ -0,0 +1,29 @@
+/*
+ * (C) 2014 see Authors.txt
+ *
+ * This file is part of MPC-HC.
+ *
+ * MPC-HC is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MPC-HC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+interface __declspec(uuid("0A55D740-3141-4DA9-8261-104188C2D974"))
+IBufferControl :
+public IUnknown {
+    // Depth of the queues of the output pins in time, 0 selects a default depending on the source
+    STDMETHOD(SetBufferDuration(REFERENCE_TIME rtDuration)) = 0;
+    STDMETHOD_(REFERENCE_TIME, GetBufferDuration()) = 0;
+};
@@ -0,0 +1,28 @@
+/*
+ * (C) 2014 see Authors.txt
+ *
+ * This file is part of MPC-HC.
+ *
+ * MPC-HC is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MPC-HC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+interface __declspec(uuid("F8FC7051-7355-412F-B314-5814A528B89E"))
+IBufferPoolInfo :
+public IUnknown {
+    // The pool is shared by all the splitters of the process, the numbers aren't specific to this filter
+    STDMETHOD(GetPoolStatus(int& blocks, int& size, int& hitRate)) = 0;
+};
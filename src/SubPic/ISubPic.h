@@ -33,6 +33,7 @@ struct SubPicDesc {
     BYTE* bitsU;
     BYTE* bitsV;
     RECT vidrect; // video rectangle
+    const DWORD* clut; // palette of the 8 bpp palette-indexed pictures, only produced by the compressed CMemSubPic
 
     struct SubPicDesc()
         : type(0)
@@ -43,7 +44,8 @@ struct SubPicDesc {
         , pitchUV(0)
         , bits(nullptr)
         , bitsU(nullptr)
-        , bitsV(nullptr) {
+        , bitsV(nullptr)
+        , clut(nullptr) {
         ZeroMemory(&vidrect, sizeof(vidrect));
     }
 };
@@ -147,6 +149,18 @@ public IUnknown {
     STDMETHOD(GetRelativeTo)(POSITION pos, RelativeTo & relativeTo) PURE;
 };
 
+//
+// ISubPicProviderSnapshot
+//
+
+interface __declspec(uuid("3B0F4E52-5C7A-4D8E-9E0B-7A61C2D94F13"))
+ISubPicProviderSnapshot :
+public IUnknown {
+    // Returns an immutable copy of the current state of the provider. The copy has its own
+    // lock so it can be rendered without blocking the threads editing the original provider.
+    STDMETHOD(GetSnapshot)(ISubPicProvider** ppSnapshot /*[out]*/) PURE;
+};
+
 //
 // ISubPicQueue
 //
@@ -169,6 +183,83 @@ public IUnknown {
     STDMETHOD_(bool, LookupSubPic)(REFERENCE_TIME rtNow /*[in]*/, bool bAdviseBlocking, CComPtr<ISubPic>& pSubPic /*[out]*/) PURE;
 };
 
+//
+// ISubPicQueueTelemetry
+//
+
+struct SubPicQueueHistogram {
+    // Bucket i counts the samples shorter than 0.1 ms * 2^i, the last bucket gets everything longer
+    static const int BUCKETS = 16;
+    static const REFERENCE_TIME FIRST_BUCKET_LIMIT = 1000;
+
+    ULONGLONG nSamples;
+    REFERENCE_TIME rtTotal;
+    REFERENCE_TIME rtMax;
+    ULONGLONG buckets[BUCKETS];
+
+    SubPicQueueHistogram() {
+        Reset();
+    }
+
+    void Reset() {
+        nSamples = 0;
+        rtTotal = rtMax = 0;
+        ZeroMemory(buckets, sizeof(buckets));
+    }
+
+    void AddSample(REFERENCE_TIME rtDuration) {
+        int i = 0;
+        for (REFERENCE_TIME rtLimit = FIRST_BUCKET_LIMIT; i < BUCKETS - 1 && rtDuration >= rtLimit; rtLimit *= 2) {
+            i++;
+        }
+        buckets[i]++;
+        nSamples++;
+        rtTotal += rtDuration;
+        if (rtDuration > rtMax) {
+            rtMax = rtDuration;
+        }
+    }
+
+    REFERENCE_TIME GetAverage() const {
+        return nSamples ? rtTotal / REFERENCE_TIME(nSamples) : 0;
+    }
+};
+
+struct SubPicQueueTelemetry {
+    ULONGLONG nRendered;        // subpics rendered by the queue
+    ULONGLONG nPresented;       // subpics handed to the presenter
+    ULONGLONG nLookups;         // calls to LookupSubPic
+    ULONGLONG nLookupMisses;    // lookups which didn't find a matching subpic in the queue
+    ULONGLONG nBlockingWaits;   // lookups which had to wait for the queue
+    ULONGLONG nDropped;         // queued subpics discarded before being presented
+    ULONGLONG nInvalidated;     // subpics discarded because of an invalidation
+    ULONGLONG nMerged;          // rendered subpics merged into an identical queued subpic
+
+    SubPicQueueHistogram renderDuration;    // time spent rendering one subpic
+    SubPicQueueHistogram queueLatency;      // time between enqueuing and presenting a subpic
+    SubPicQueueHistogram blockingWait;      // time spent waiting in a blocking lookup
+    SubPicQueueHistogram providerLockWait;  // time spent waiting for the subpic provider lock
+
+    SubPicQueueTelemetry() {
+        Reset();
+    }
+
+    void Reset() {
+        nRendered = nPresented = nLookups = nLookupMisses = nBlockingWaits = nDropped = nInvalidated = nMerged = 0;
+        renderDuration.Reset();
+        queueLatency.Reset();
+        blockingWait.Reset();
+        providerLockWait.Reset();
+    }
+};
+
+interface __declspec(uuid("75A71851-7F58-4600-991C-5AE2C5B37F98"))
+ISubPicQueueTelemetry :
+public IUnknown {
+    STDMETHOD(GetTelemetry)(SubPicQueueTelemetry& telemetry /*[out]*/) PURE;
+    STDMETHOD(ResetTelemetry)() PURE;
+};
+
 //
 // ISubPicAllocatorPresenter
 //
@@ -84,9 +84,10 @@ void ColorConvInit()
 // CMemSubPic
 //
 
-CMemSubPic::CMemSubPic(const SubPicDesc& spd, CMemSubPicAllocator* pAllocator)
+CMemSubPic::CMemSubPic(const SubPicDesc& spd, CMemSubPicAllocator* pAllocator, bool bCompress /*= false*/)
     : m_pAllocator(pAllocator)
     , m_spd(spd)
+    , m_bCompress(bCompress)
 {
     m_maxsize.SetSize(spd.w, spd.h);
     m_rcDirty.SetRect(0, 0, spd.w, spd.h);
@@ -94,21 +95,212 @@ CMemSubPic::CMemSubPic(const SubPicDesc& spd, CMemSubPicAllocator* pAllocator)
 
 CMemSubPic::~CMemSubPic()
 {
-    m_pAllocator->FreeSpdBits(m_spd);
+    if (m_spd.bits) {
+        m_pAllocator->FreeSpdBits(m_spd);
+    }
     if (m_resizedSpd) {
         m_pAllocator->FreeSpdBits(*m_resizedSpd);
     }
 }
 
+// private
+
+void CMemSubPic::Compress(const SubPicDesc& src, const CRect& rc, bool bResized)
+{
+    // The uncompressed bits are not needed anymore, give them back to the allocator
+    if (m_spd.bits) {
+        m_pAllocator->FreeSpdBits(m_spd);
+    }
+
+    if (!m_pCompressed) {
+        m_pCompressed = std::make_unique<CompressedBits>();
+    }
+
+    m_pCompressed->spd = src;
+    m_pCompressed->spd.bits = nullptr;
+    m_pCompressed->rc = rc;
+    m_pCompressed->bResized = bResized;
+
+    std::vector<DWORD>& data = m_pCompressed->data;
+    data.clear();
+
+    // The palette form is kept only when the run-length encoding can't beat its size
+    bool bIndexed = CompressIndexed(src, rc);
+    size_t maxSize = bIndexed
+                     ? (m_pCompressed->indexes.size() + sizeof(m_pCompressed->clut) + sizeof(DWORD) - 1) / sizeof(DWORD)
+                     : SIZE_MAX;
+
+    // Each row is stored as a sequence of tokens: either a run (count | RLE_RUN_FLAG)
+    // followed by the repeated pixel, or a count followed by as many literal pixels
+    for (int y = rc.top, w = rc.Width(); y < rc.bottom; y++) {
+        const DWORD* p = (const DWORD*)(src.bits + src.pitch * y) + rc.left;
+
+        for (int x = 0; x < w;) {
+            int run = 1;
+            while (x + run < w && p[x + run] == p[x]) {
+                run++;
+            }
+
+            if (run >= 3) {
+                data.push_back(RLE_RUN_FLAG | DWORD(run));
+                data.push_back(p[x]);
+                x += run;
+            } else {
+                // Gather literal pixels until the next run worth encoding
+                int start = x;
+                for (x += run; x < w && !(x + 2 < w && p[x] == p[x + 1] && p[x] == p[x + 2]); x++) {
+                    ;
+                }
+                data.push_back(DWORD(x - start));
+                data.insert(data.end(), p + start, p + x);
+            }
+        }
+
+        if (data.size() >= maxSize) {
+            break;
+        }
+    }
+
+    m_pCompressed->bIndexed = bIndexed && data.size() >= maxSize;
+    if (m_pCompressed->bIndexed) {
+        data.clear();
+    } else {
+        m_pCompressed->indexes.clear();
+        m_pCompressed->indexes.shrink_to_fit();
+    }
+    data.shrink_to_fit();
+}
+
+bool CMemSubPic::CompressIndexed(const SubPicDesc& src, const CRect& rc)
+{
+    std::vector<BYTE>& indexes = m_pCompressed->indexes;
+    std::array<DWORD, 256>& clut = m_pCompressed->clut;
+
+    // Open addressing hash table mapping the colors to their index in the palette
+    const size_t HASH_SIZE = 1024;
+    std::array<int, HASH_SIZE> hash;
+    hash.fill(-1);
+    size_t nColors = 0;
+
+    int w = rc.Width();
+    indexes.resize(size_t(w) * rc.Height());
+    BYTE* d = indexes.data();
+
+    for (int y = rc.top; y < rc.bottom; y++) {
+        const DWORD* p = (const DWORD*)(src.bits + src.pitch * y) + rc.left;
+
+        for (int x = 0; x < w; x++, d++) {
+            // Consecutive pixels are very likely to have the same color
+            if (x > 0 && p[x] == p[x - 1]) {
+                *d = d[-1];
+                continue;
+            }
+
+            size_t h = (p[x] * 2654435761u) >> 22;
+            while (hash[h] >= 0 && clut[hash[h]] != p[x]) {
+                h = (h + 1) & (HASH_SIZE - 1);
+            }
+            if (hash[h] < 0) {
+                if (nColors == clut.size()) {
+                    return false;
+                }
+                clut[nColors] = p[x];
+                hash[h] = int(nColors++);
+            }
+            *d = BYTE(hash[h]);
+        }
+    }
+
+    // Unused entries are transparent
+    std::fill(clut.begin() + nColors, clut.end(), 0xff000000);
+    indexes.shrink_to_fit();
+
+    return true;
+}
+
+bool CMemSubPic::Decompress(SubPicDesc& dst) const
+{
+    if (!m_pCompressed || !dst.bits) {
+        return false;
+    }
+
+    const CRect& rc = m_pCompressed->rc;
+
+    if (m_pCompressed->bIndexed) {
+        const BYTE* p = m_pCompressed->indexes.data();
+        const DWORD* clut = m_pCompressed->clut.data();
+
+        for (int y = rc.top, w = rc.Width(); y < rc.bottom; y++, p += w) {
+            DWORD* d = (DWORD*)(dst.bits + dst.pitch * y) + rc.left;
+            for (int x = 0; x < w; x++) {
+                d[x] = clut[p[x]];
+            }
+        }
+
+        return true;
+    }
+
+    const DWORD* p = m_pCompressed->data.data();
+
+    for (int y = rc.top; y < rc.bottom; y++) {
+        DWORD* d = (DWORD*)(dst.bits + dst.pitch * y) + rc.left;
+        DWORD* e = d + rc.Width();
+
+        while (d < e) {
+            DWORD n = *p & ~RLE_RUN_FLAG;
+            if (*p++ & RLE_RUN_FLAG) {
+                memsetd(d, *p++, n * 4);
+            } else {
+                memcpy(d, p, n * 4);
+                p += n;
+            }
+            d += n;
+        }
+    }
+
+    return true;
+}
+
+bool CMemSubPic::Inflate()
+{
+    if (!m_spd.bits && !m_pAllocator->AllocSpdBits(m_spd)) {
+        return false;
+    }
+
+    if (m_pCompressed) {
+        if (m_pCompressed->bResized) {
+            if (!m_resizedSpd) {
+                m_resizedSpd = std::unique_ptr<SubPicDesc>(DEBUG_NEW SubPicDesc(m_pCompressed->spd));
+                if (!m_pAllocator->AllocSpdBits(*m_resizedSpd)) {
+                    m_resizedSpd = nullptr;
+                    return false;
+                }
+            }
+            Decompress(*m_resizedSpd);
+        } else {
+            Decompress(m_spd);
+        }
+        m_pCompressed = nullptr;
+    }
+
+    return true;
+}
+
 // ISubPic
 
 STDMETHODIMP_(void*) CMemSubPic::GetObject()
 {
+    Inflate();
+
     return (void*)&m_spd;
 }
 
 STDMETHODIMP CMemSubPic::GetDesc(SubPicDesc& spd)
 {
+    if (!Inflate()) {
+        return E_OUTOFMEMORY;
+    }
+
     spd.type = m_spd.type;
     spd.w = m_spd.w;
     spd.h = m_spd.h;
@@ -130,17 +322,34 @@ STDMETHODIMP CMemSubPic::CopyTo(ISubPic* pSubPic)
     }
 
     SubPicDesc src, dst;
-    if (FAILED(GetDesc(src)) || FAILED(pSubPic->GetDesc(dst))) {
+    if (FAILED(GetDesc(src))) {
         return E_FAIL;
     }
 
-    if (auto subPic = dynamic_cast<CMemSubPic*>(pSubPic)) {
+    auto subPic = dynamic_cast<CMemSubPic*>(pSubPic);
+    if (subPic) {
         ASSERT(subPic->m_pAllocator == m_pAllocator);
         ASSERT(subPic->m_resizedSpd == nullptr);
         // Move because we are not going to reuse it.
         subPic->m_resizedSpd = std::move(m_resizedSpd);
     }
 
+    if (subPic && subPic->m_bCompress) {
+        if (subPic->m_resizedSpd) {
+            const SubPicDesc& resized = *subPic->m_resizedSpd;
+            subPic->Compress(resized, CRect(0, 0, resized.w, resized.h), true);
+            m_pAllocator->FreeSpdBits(*subPic->m_resizedSpd);
+            subPic->m_resizedSpd = nullptr;
+        } else {
+            subPic->Compress(src, m_rcDirty, false);
+        }
+        return S_OK;
+    }
+
+    if (FAILED(pSubPic->GetDesc(dst))) {
+        return E_FAIL;
+    }
+
     int w = m_rcDirty.Width(), h = m_rcDirty.Height();
     BYTE* s = src.bits + src.pitch * m_rcDirty.top + m_rcDirty.left * 4;
     BYTE* d = dst.bits + dst.pitch * m_rcDirty.top + m_rcDirty.left * 4;
@@ -158,6 +367,10 @@ STDMETHODIMP CMemSubPic::ClearDirtyRect(DWORD color)
         return S_FALSE;
     }
 
+    if (!Inflate()) {
+        return E_OUTOFMEMORY;
+    }
+
     BYTE* p = m_spd.bits + m_spd.pitch * m_rcDirty.top + m_rcDirty.left * (m_spd.bpp >> 3);
     for (ptrdiff_t j = 0, h = m_rcDirty.Height(); j < h; j++, p += m_spd.pitch) {
         int w = m_rcDirty.Width();
@@ -411,6 +624,88 @@ void AlphaBlt_YUY2_C(int w, int h, BYTE* d, int dstpitch, BYTE* s, int srcpitch)
     }
 }
 
+void AlphaBlt_CLUT_SSE2(int w, int h, BYTE* d, int dstpitch, const BYTE* s, int srcpitch, const DWORD* clut)
+{
+    // Precompute the source part of the 32-bit blend for every palette entry so that
+    // each channel ends up as (((d * a + mul) >> 8) + add) & 0xff, which gives exactly
+    // the same result as the C code blending the expanded pictures, including the
+    // carry that the blue channel propagates into the red one when it wraps
+    __declspec(align(16)) UINT64 mul[256], add[256];
+    for (size_t i = 0; i < _countof(mul); i++) {
+        DWORD c = clut[i];
+        UINT64 b = c & 0xff, g = (c >> 8) & 0xff, r = (c >> 16) & 0xff;
+#ifdef _WIN64
+        UINT64 ia = 256 - (c >> 24);
+        mul[i] = ((g * ia) << 16) | ((r * ia) << 32);
+        add[i] = (b * ia) >> 8;
+#else
+        mul[i] = 0;
+        add[i] = b | (g << 16) | (r << 32);
+#endif
+    }
+
+    const __m128i mm_zero = _mm_setzero_si128();
+    const __m128i mm_transparent = _mm_set1_epi32(0xff);
+    const __m128i mm_byte = _mm_set1_epi16(0xff);
+    const __m128i mm_blue = _mm_set_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+    const __m128i mm_colorMask = _mm_set1_epi32(0x00ffffff);
+
+    for (ptrdiff_t j = 0; j < h; j++, s += srcpitch, d += dstpitch) {
+        DWORD* d2 = (DWORD*)d;
+        int i = 0;
+
+        for (; i + 4 <= w; i += 4) {
+            __m128i mm_a = _mm_srli_epi32(_mm_set_epi32(clut[s[i + 3]], clut[s[i + 2]], clut[s[i + 1]], clut[s[i]]), 24);
+            // Fully transparent pixels leave the target untouched
+            __m128i mm_skip = _mm_cmpeq_epi32(mm_a, mm_transparent);
+            if (_mm_movemask_epi8(mm_skip) == 0xffff) {
+                continue;
+            }
+
+            // Spread the alpha of each pixel over its four 16-bit channels
+            mm_a = _mm_or_si128(mm_a, _mm_slli_epi32(mm_a, 16));
+            __m128i mm_d = _mm_loadu_si128((__m128i*)(d2 + i));
+            __m128i mm_r[2];
+
+            for (int k = 0; k < 2; k++) {
+                const BYTE* p = s + i + k * 2;
+                __m128i mm_mul = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)&mul[p[0]]), _mm_loadl_epi64((const __m128i*)&mul[p[1]]));
+                __m128i mm_add = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)&add[p[0]]), _mm_loadl_epi64((const __m128i*)&add[p[1]]));
+                __m128i mm_t = k == 0
+                               ? _mm_mullo_epi16(_mm_unpacklo_epi8(mm_d, mm_zero), _mm_unpacklo_epi32(mm_a, mm_a))
+                               : _mm_mullo_epi16(_mm_unpackhi_epi8(mm_d, mm_zero), _mm_unpackhi_epi32(mm_a, mm_a));
+                mm_t = _mm_add_epi16(mm_t, mm_mul);
+
+                // Move the carry out of the blue channel into the red one
+                __m128i mm_carry = _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(mm_t, 8), mm_add), 8);
+                mm_t = _mm_add_epi16(mm_t, _mm_slli_epi64(_mm_and_si128(mm_carry, mm_blue), 32));
+
+                // Wrap around like the C code instead of saturating
+                mm_r[k] = _mm_and_si128(_mm_add_epi16(_mm_srli_epi16(mm_t, 8), mm_add), mm_byte);
+            }
+
+            __m128i mm_res = _mm_and_si128(_mm_packus_epi16(mm_r[0], mm_r[1]), mm_colorMask);
+            mm_res = _mm_or_si128(_mm_and_si128(mm_skip, mm_d), _mm_andnot_si128(mm_skip, mm_res));
+            _mm_storeu_si128((__m128i*)(d2 + i), mm_res);
+        }
+
+        for (; i < w; i++) {
+            DWORD c = clut[s[i]];
+            DWORD a = c >> 24;
+            if (a < 0xff) {
+#ifdef _WIN64
+                DWORD ia = 256 - a;
+                d2[i] = ((((d2[i] & 0x00ff00ff) * a) >> 8) + (((c & 0x00ff00ff) * ia) >> 8) & 0x00ff00ff)
+                        | ((((d2[i] & 0x0000ff00) * a) >> 8) + (((c & 0x0000ff00) * ia) >> 8) & 0x0000ff00);
+#else
+                d2[i] = ((((d2[i] & 0x00ff00ff) * a) >> 8) + (c & 0x00ff00ff) & 0x00ff00ff)
+                        | ((((d2[i] & 0x0000ff00) * a) >> 8) + (c & 0x0000ff00) & 0x0000ff00);
+#endif
+            }
+        }
+    }
+}
+
 STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
 {
     ASSERT(pTarget);
@@ -419,7 +714,47 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
         return E_POINTER;
     }
 
-    const SubPicDesc& src = m_resizedSpd ? *m_resizedSpd : m_spd;
+    if (m_pCompressed && m_pCompressed->bIndexed
+            && (pTarget->type == MSP_RGB32 || pTarget->type == MSP_AYUV)) {
+        // Blend the palette indexes directly if they cover the source rectangle
+        const CompressedBits& compressed = *m_pCompressed;
+        CRect rs(*pSrc);
+
+        if (compressed.bResized || (rs & compressed.rc) == rs) {
+            SubPicDesc src = compressed.spd;
+            src.w = compressed.rc.Width();
+            src.h = compressed.rc.Height();
+            src.bpp = 8;
+            src.pitch = src.w;
+            src.bits = const_cast<BYTE*>(compressed.indexes.data());
+            src.clut = compressed.clut.data();
+
+            rs.OffsetRect(-compressed.rc.TopLeft());
+            return AlphaBlt(src, compressed.bResized, rs, pDst, pTarget);
+        }
+    }
+
+    if (m_pCompressed) {
+        // Expand the queued subpic into a temporary buffer recycled by the allocator
+        SubPicDesc src = m_pCompressed->spd;
+        if (!m_pAllocator->AllocSpdBits(src)) {
+            return E_OUTOFMEMORY;
+        }
+        Decompress(src);
+        HRESULT hr = AlphaBlt(src, m_pCompressed->bResized, pSrc, pDst, pTarget);
+        m_pAllocator->FreeSpdBits(src);
+        return hr;
+    }
+
+    if (!Inflate()) {
+        return E_OUTOFMEMORY;
+    }
+
+    return m_resizedSpd ? AlphaBlt(*m_resizedSpd, true, pSrc, pDst, pTarget) : AlphaBlt(m_spd, false, pSrc, pDst, pTarget);
+}
+
+HRESULT CMemSubPic::AlphaBlt(const SubPicDesc& src, bool bResized, RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
+{
     SubPicDesc dst = *pTarget; // copy, because we might modify it
 
     if (src.type != dst.type) {
@@ -428,8 +763,8 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
 
     CRect rs(*pSrc), rd(*pDst);
 
-    if (m_resizedSpd) {
-        rs = rd = CRect(0, 0, m_resizedSpd->w, m_resizedSpd->h);
+    if (bResized) {
+        rs = rd = CRect(0, 0, src.w, src.h);
     }
 
     if (dst.h < 0) {
@@ -443,7 +778,7 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
     }
 
     int w = rs.Width(), h = rs.Height();
-    BYTE* s = src.bits + src.pitch * rs.top + rs.left * 4;
+    BYTE* s = src.bits + src.pitch * rs.top + ((rs.left * src.bpp) >> 3);
     BYTE* d = dst.bits + dst.pitch * rd.top + ((rd.left * dst.bpp) >> 3);
 
     if (rd.top > rd.bottom) {
@@ -460,6 +795,16 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
         dst.pitch = -dst.pitch;
     }
 
+    if (src.bpp == 8) {
+        // Palette-indexed pictures are only blended on 32-bit targets
+        if (!src.clut || (dst.type != MSP_RGB32 && dst.type != MSP_AYUV)) {
+            return E_NOTIMPL;
+        }
+
+        AlphaBlt_CLUT_SSE2(w, h, d, dst.pitch, s, src.pitch, src.clut);
+        return S_OK;
+    }
+
     // TODO: m_bInvAlpha support
     switch (dst.type) {
         case MSP_RGBA:
@@ -629,10 +974,11 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
 // CMemSubPicAllocator
 //
 
-CMemSubPicAllocator::CMemSubPicAllocator(int type, SIZE maxsize)
+CMemSubPicAllocator::CMemSubPicAllocator(int type, SIZE maxsize, bool bCompressDynamic /*= false*/)
     : CSubPicAllocatorImpl(maxsize, false)
     , m_type(type)
     , m_maxsize(maxsize)
+    , m_bCompressDynamic(bCompressDynamic)
 {
 }
 
@@ -661,12 +1007,15 @@ bool CMemSubPicAllocator::Alloc(bool fStatic, ISubPic** ppSubPic)
     spd.type = m_type;
     spd.vidrect = m_curvidrect;
 
-    if (!AllocSpdBits(spd)) {
+    // Compressed dynamic subpics only get their bits allocated on demand
+    bool bCompress = !fStatic && m_bCompressDynamic;
+
+    if (!bCompress && !AllocSpdBits(spd)) {
         return false;
     }
 
     try {
-        *ppSubPic = DEBUG_NEW CMemSubPic(spd, this);
+        *ppSubPic = DEBUG_NEW CMemSubPic(spd, this, bCompress);
     } catch (CMemoryException* e) {
         e->Delete();
         delete [] spd.bits;
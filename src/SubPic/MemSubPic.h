@@ -22,6 +22,7 @@
 #pragma once
 
 #include "SubPicImpl.h"
+#include <array>
 #include <memory>
 #include <vector>
 
@@ -46,11 +47,40 @@ class CMemSubPic : public CSubPicImpl
     SubPicDesc m_spd;
     std::unique_ptr<SubPicDesc> m_resizedSpd;
 
+    // Compressed copy of the dirty rectangle, used instead of m_spd.bits by
+    // the dynamic subpics kept in the subpic queue when the allocator was
+    // asked to compress them. The providers always render 32-bit pixels,
+    // the pictures which turn out to have no more than 256 colors, like
+    // bitmap subtitles, are converted to palette indexes unless the
+    // run-length encoding is smaller, the others are run-length encoded.
+    struct CompressedBits {
+        SubPicDesc spd; // geometry of the uncompressed picture, bits is always nullptr
+        CRect rc;       // area covered by the encoded rows
+        bool bResized;  // true if the data comes from a resized picture
+        bool bIndexed;  // true if indexes and clut are used instead of data
+        std::vector<DWORD> data;
+        std::vector<BYTE> indexes;
+        std::array<DWORD, 256> clut;
+    };
+
+    // Set in the count of a run-length encoded token which repeats the next pixel
+    static const DWORD RLE_RUN_FLAG = 0x80000000;
+
+    bool m_bCompress;
+    std::unique_ptr<CompressedBits> m_pCompressed;
+
+    void Compress(const SubPicDesc& src, const CRect& rc, bool bResized);
+    bool CompressIndexed(const SubPicDesc& src, const CRect& rc);
+    bool Decompress(SubPicDesc& dst) const;
+    bool Inflate();
+
+    HRESULT AlphaBlt(const SubPicDesc& src, bool bResized, RECT* pSrc, RECT* pDst, SubPicDesc* pTarget);
+
 protected:
     STDMETHODIMP_(void*) GetObject(); // returns SubPicDesc*
 
 public:
-    CMemSubPic(const SubPicDesc& spd, CMemSubPicAllocator* pAllocator);
+    CMemSubPic(const SubPicDesc& spd, CMemSubPicAllocator* pAllocator, bool bCompress = false);
     virtual ~CMemSubPic();
 
     // ISubPic
@@ -69,13 +99,14 @@ class CMemSubPicAllocator : public CSubPicAllocatorImpl, public CCritSec
     int m_type;
     CSize m_maxsize;
     CRect m_curvidrect;
+    bool m_bCompressDynamic;
 
     std::vector<std::pair<size_t, BYTE*>> m_freeMemoryChunks;
 
     bool Alloc(bool fStatic, ISubPic** ppSubPic);
 
 public:
-    CMemSubPicAllocator(int type, SIZE maxsize);
+    CMemSubPicAllocator(int type, SIZE maxsize, bool bCompressDynamic = false);
     virtual ~CMemSubPicAllocator();
 
     bool AllocSpdBits(SubPicDesc& spd);
@@ -43,6 +43,8 @@ CSubPicQueueImpl::CSubPicQueueImpl(SubPicQueueSettings settings, ISubPicAllocato
     , m_settings(settings)
     , m_pAllocator(pAllocator)
 {
+    QueryPerformanceFrequency(&m_llPerfFrequency);
+
     if (phr) {
         *phr = S_OK;
     }
@@ -63,6 +65,7 @@ STDMETHODIMP CSubPicQueueImpl::NonDelegatingQueryInterface(REFIID riid, void** p
 {
     return
         QI(ISubPicQueue)
+        QI(ISubPicQueueTelemetry)
         __super::NonDelegatingQueryInterface(riid, ppv);
 }
 
@@ -73,6 +76,7 @@ STDMETHODIMP CSubPicQueueImpl::SetSubPicProvider(ISubPicProvider* pSubPicProvide
     CAutoLock cAutoLock(&m_csSubPicProvider);
 
     m_pSubPicProviderWithSharedLock = std::make_shared<SubPicProviderWithSharedLock>(pSubPicProvider);
+    m_pSnapshotWithSharedLock = nullptr;
 
     Invalidate();
 
@@ -107,18 +111,108 @@ STDMETHODIMP CSubPicQueueImpl::SetTime(REFERENCE_TIME rtNow)
     return S_OK;
 }
 
+// ISubPicQueueTelemetry
+
+STDMETHODIMP CSubPicQueueImpl::GetTelemetry(SubPicQueueTelemetry& telemetry)
+{
+    std::lock_guard<std::mutex> lock(m_mutexTelemetry);
+
+    telemetry = m_telemetry;
+
+    return S_OK;
+}
+
+STDMETHODIMP CSubPicQueueImpl::ResetTelemetry()
+{
+    std::lock_guard<std::mutex> lock(m_mutexTelemetry);
+
+    m_telemetry.Reset();
+
+    return S_OK;
+}
+
 // private
 
-HRESULT CSubPicQueueImpl::RenderTo(ISubPic* pSubPic, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop, double fps, BOOL bIsAnimated)
+ULONGLONG CSubPicQueueImpl::HashSubPicContent(const SubPicDesc& spd, const CRect& r)
 {
-    CheckPointer(pSubPic, E_POINTER);
+    // Hash the dirty rectangle and its content, two pixels at a time
+    ULONGLONG hash = 0xcbf29ce484222325ull;
+    hash = HashCombine(hash, ULONGLONG(r.left) << 32 | DWORD(r.top));
+    hash = HashCombine(hash, ULONGLONG(r.right) << 32 | DWORD(r.bottom));
+
+    CRect rc = r & CRect(0, 0, spd.w, spd.h);
+    if (rc.IsRectEmpty()) {
+        return hash;
+    }
+    // only the packed 32-bit formats are hashed, the others can have several planes
+    if (spd.bpp != 32) {
+        return NO_CONTENT_HASH;
+    }
 
-    HRESULT hr = E_FAIL;
+    for (int y = rc.top; y < rc.bottom; y++) {
+        const DWORD* p = (const DWORD*)(spd.bits + spd.pitch * y) + rc.left;
+        const DWORD* pEnd = p + rc.Width();
+        for (; p + 1 < pEnd; p += 2) {
+            hash = HashCombine(hash, *(const ULONGLONG*)p);
+        }
+        if (p < pEnd) {
+            hash = HashCombine(hash, *p);
+        }
+    }
+
+    return hash != NO_CONTENT_HASH ? hash : 1;
+}
+
+std::shared_ptr<CSubPicQueueImpl::SubPicProviderWithSharedLock> CSubPicQueueImpl::GetSubPicProviderSnapshotWithSharedLock()
+{
+    auto pSubPicProviderWithSharedLock = GetSubPicProviderWithSharedLock();
+
+    if (pSubPicProviderWithSharedLock) {
+        CComQIPtr<ISubPicProviderSnapshot> pSubPicProviderSnapshot = pSubPicProviderWithSharedLock->pSubPicProvider;
+        CComPtr<ISubPicProvider> pSnapshot;
+
+        // The provider only creates a new snapshot when it was modified, otherwise
+        // the same one is returned and we keep sharing its lock wrapper
+        if (pSubPicProviderSnapshot && SUCCEEDED(pSubPicProviderSnapshot->GetSnapshot(&pSnapshot)) && pSnapshot) {
+            CAutoLock cAutoLock(&m_csSubPicProvider);
+
+            if (pSubPicProviderWithSharedLock == m_pSubPicProviderWithSharedLock) {
+                if (!m_pSnapshotWithSharedLock || m_pSnapshotWithSharedLock->pSubPicProvider != pSnapshot) {
+                    m_pSnapshotWithSharedLock = std::make_shared<SubPicProviderWithSharedLock>(pSnapshot);
+                }
+                return m_pSnapshotWithSharedLock;
+            }
+        }
+    }
+
+    return pSubPicProviderWithSharedLock;
+}
+
+REFERENCE_TIME CSubPicQueueImpl::GetPerfCounter() const
+{
+    LARGE_INTEGER llTicks;
+
+    QueryPerformanceCounter(&llTicks);
+    return llMulDiv(llTicks.QuadPart, 10000000, m_llPerfFrequency.QuadPart, 0);
+}
+
+HRESULT CSubPicQueueImpl::RenderTo(ISubPic* pSubPic, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop, double fps, BOOL bIsAnimated)
+{
     CComPtr<ISubPicProvider> pSubPicProvider;
     if (FAILED(GetSubPicProvider(&pSubPicProvider)) || !pSubPicProvider) {
-        return hr;
+        return E_FAIL;
     }
 
+    return RenderTo(pSubPic, pSubPicProvider, rtStart, rtStop, fps, bIsAnimated);
+}
+
+HRESULT CSubPicQueueImpl::RenderTo(ISubPic* pSubPic, ISubPicProvider* pSubPicProvider, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop, double fps, BOOL bIsAnimated, ULONGLONG* pContentHash /*= nullptr*/)
+{
+    CheckPointer(pSubPic, E_POINTER);
+    CheckPointer(pSubPicProvider, E_POINTER);
+
+    HRESULT hr = E_FAIL;
+
     if (pSubPic->GetInverseAlpha()) {
         hr = pSubPic->ClearDirtyRect(0x00000000);
     } else {
@@ -141,6 +235,10 @@ HRESULT CSubPicQueueImpl::RenderTo(ISubPic* pSubPic, REFERENCE_TIME rtStart, REF
         }
         hr = pSubPicProvider->Render(spd, rtRender, fps, r);
 
+        if (pContentHash) {
+            *pContentHash = HashSubPicContent(spd, r);
+        }
+
         pSubPic->SetStart(rtStart);
         pSubPic->SetStop(rtStop);
 
@@ -249,6 +347,10 @@ STDMETHODIMP CSubPicQueue::Invalidate(REFERENCE_TIME rtInvalidate /*= -1*/)
         TRACE(_T("  %f -> %f -> %f\n"), double(rtStart) / 10000000.0, double(rtStop) / 10000000.0, double(rtSegmentStop) / 10000000.0);
 #endif
         m_queue.RemoveTailNoReturn();
+        m_queueEnqueueTimes.RemoveTailNoReturn();
+        UpdateTelemetry([](SubPicQueueTelemetry& telemetry) {
+            telemetry.nInvalidated++;
+        });
     }
 
     // If we invalidate in the past, always give the queue a chance to re-render the modified subtitles
@@ -272,6 +374,7 @@ STDMETHODIMP_(bool) CSubPicQueue::LookupSubPic(REFERENCE_TIME rtNow, CComPtr<ISu
 STDMETHODIMP_(bool) CSubPicQueue::LookupSubPic(REFERENCE_TIME rtNow, bool bAdviseBlocking, CComPtr<ISubPic>& ppSubPic)
 {
     bool bStopSearch = false;
+    bool bMissed = false;
 
     {
         std::lock_guard<std::mutex> lock(m_mutexSubpic);
@@ -357,7 +460,19 @@ STDMETHODIMP_(bool) CSubPicQueue::LookupSubPic(REFERENCE_TIME rtNow, bool bAdvis
                     }
 
                     if (bRemoveFromQueue) {
+                        bool bPresented = (ppSubPic.p == pSubPic.p);
+                        REFERENCE_TIME rtEnqueued = m_queueEnqueueTimes.RemoveHead();
                         m_queue.RemoveHeadNoReturn();
+
+                        REFERENCE_TIME rtPerfNow = GetPerfCounter();
+                        UpdateTelemetry([&](SubPicQueueTelemetry& telemetry) {
+                            if (bPresented) {
+                                telemetry.nPresented++;
+                                telemetry.queueLatency.AddSample(rtPerfNow - rtEnqueued);
+                            } else {
+                                telemetry.nDropped++;
+                            }
+                        });
                     }
                 }
             }
@@ -366,13 +481,23 @@ STDMETHODIMP_(bool) CSubPicQueue::LookupSubPic(REFERENCE_TIME rtNow, bool bAdvis
             m_condQueueFull.notify_one();
         }
 
+        if (!ppSubPic) {
+            bMissed = true;
+        }
+
         // If we didn't get any subpic yet and blocking is advised, just try harder to get one
         if (!ppSubPic && bTryBlocking) {
             bTryBlocking = false;
             bStopSearch = true;
 
-            auto pSubPicProviderWithSharedLock = GetSubPicProviderWithSharedLock();
+            auto pSubPicProviderWithSharedLock = GetSubPicProviderSnapshotWithSharedLock();
+            REFERENCE_TIME rtLockStart = GetPerfCounter();
             if (pSubPicProviderWithSharedLock && SUCCEEDED(pSubPicProviderWithSharedLock->Lock())) {
+                REFERENCE_TIME rtLockWait = GetPerfCounter() - rtLockStart;
+                UpdateTelemetry([rtLockWait](SubPicQueueTelemetry& telemetry) {
+                    telemetry.providerLockWait.AddSample(rtLockWait);
+                });
+
                 auto& pSubPicProvider = pSubPicProviderWithSharedLock->pSubPicProvider;
                 double fps = m_fps;
                 if (POSITION pos = pSubPicProvider->GetStartPosition(rtNow, fps)) {
@@ -392,7 +517,14 @@ STDMETHODIMP_(bool) CSubPicQueue::LookupSubPic(REFERENCE_TIME rtNow, bool bAdvis
                                || (!m_queue.IsEmpty() && m_queue.GetTail()->GetStop() > rtNow);
                     };
 
+                    REFERENCE_TIME rtWaitStart = GetPerfCounter();
                     m_condQueueReady.wait(lock, queueReady);
+                    REFERENCE_TIME rtWait = GetPerfCounter() - rtWaitStart;
+
+                    UpdateTelemetry([rtWait](SubPicQueueTelemetry& telemetry) {
+                        telemetry.nBlockingWaits++;
+                        telemetry.blockingWait.AddSample(rtWait);
+                    });
                 }
             }
         } else {
@@ -400,6 +532,13 @@ STDMETHODIMP_(bool) CSubPicQueue::LookupSubPic(REFERENCE_TIME rtNow, bool bAdvis
         }
     }
 
+    UpdateTelemetry([bMissed](SubPicQueueTelemetry& telemetry) {
+        telemetry.nLookups++;
+        if (bMissed) {
+            telemetry.nLookupMisses++;
+        }
+    });
+
     if (ppSubPic) {
         // Save the subpic for later reuse
         std::lock_guard<std::mutex> lock(m_mutexSubpic);
@@ -483,8 +622,12 @@ bool CSubPicQueue::EnqueueSubPic(CComPtr<ISubPic>& pSubPic, bool bBlocking)
 #if SUBPIC_TRACE_LEVEL > 1
             TRACE(_T("Subtitle Renderer Thread: Dropping rendered subpic because of invalidation\n"));
 #endif
+            UpdateTelemetry([](SubPicQueueTelemetry& telemetry) {
+                telemetry.nInvalidated++;
+            });
         } else {
             m_queue.AddTail(pSubPic);
+            m_queueEnqueueTimes.AddTail(GetPerfCounter());
             lock.unlock();
             m_condQueueReady.notify_one();
             bAdded = true;
@@ -495,6 +638,39 @@ bool CSubPicQueue::EnqueueSubPic(CComPtr<ISubPic>& pSubPic, bool bBlocking)
     return bAdded;
 }
 
+bool CSubPicQueue::ExtendSubPic(ISubPic* pLastSubPic, ISubPic* pSubPic)
+{
+    std::lock_guard<std::mutex> lock(m_mutexQueue);
+
+    // Only a subpic which hasn't left the queue yet can still be modified
+    if (m_queue.IsEmpty() || m_queue.GetTail() != pLastSubPic) {
+        return false;
+    }
+
+    REFERENCE_TIME rtStop = pSubPic->GetStop();
+    if (m_bInvalidate && rtStop > m_rtInvalidate) {
+        return false;
+    }
+
+    // Animated subpics can be merged inside the same segment, other subpics
+    // only when they are directly following each other
+    REFERENCE_TIME rtSegmentStart = pSubPic->GetSegmentStart();
+    if (rtSegmentStart != pLastSubPic->GetSegmentStart() || pSubPic->GetSegmentStop() != pLastSubPic->GetSegmentStop()) {
+        return false;
+    }
+    if (rtSegmentStart == ISubPic::INVALID_TIME && pLastSubPic->GetStop() != pSubPic->GetStart()) {
+        return false;
+    }
+
+#if SUBPIC_TRACE_LEVEL > 1
+    TRACE(_T("Subtitle Renderer Thread: Extending identical subpic %f -> %f\n"),
+          double(pLastSubPic->GetStop()) / 10000000.0, double(rtStop) / 10000000.0);
+#endif
+    pLastSubPic->SetStop(rtStop);
+
+    return true;
+}
+
 REFERENCE_TIME CSubPicQueue::GetCurrentRenderingTime()
 {
     REFERENCE_TIME rtNow = -1;
@@ -518,6 +694,11 @@ DWORD CSubPicQueue::ThreadProc()
     SetThreadName(DWORD(-1), "Subtitle Renderer Thread");
     SetThreadPriority(m_hThread, bDisableAnim ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_ABOVE_NORMAL);
 
+    // The last subpic we enqueued and the hash of its content, an identical
+    // subpic following it is merged into it instead of being enqueued again
+    CComPtr<ISubPic> pLastSubPic;
+    ULONGLONG llLastContentHash = 0;
+
     bool bWaitForEvent = false;
     for (; !m_bExitThread;) {
         // When we have nothing to render, we just wait a bit
@@ -526,14 +707,22 @@ DWORD CSubPicQueue::ThreadProc()
             m_runQueueEvent.Wait();
         }
 
-        auto pSubPicProviderWithSharedLock = GetSubPicProviderWithSharedLock();
+        // Render from a snapshot when possible so that editing the subtitles doesn't stall the rendering
+        auto pSubPicProviderWithSharedLock = GetSubPicProviderSnapshotWithSharedLock();
+        REFERENCE_TIME rtLockStart = GetPerfCounter();
         if (pSubPicProviderWithSharedLock && SUCCEEDED(pSubPicProviderWithSharedLock->Lock())) {
+            REFERENCE_TIME rtLockWait = GetPerfCounter() - rtLockStart;
+            UpdateTelemetry([rtLockWait](SubPicQueueTelemetry& telemetry) {
+                telemetry.providerLockWait.AddSample(rtLockWait);
+            });
+
             auto& pSubPicProvider = pSubPicProviderWithSharedLock->pSubPicProvider;
             double fps = m_fps;
             REFERENCE_TIME rtTimePerFrame = m_rtTimePerFrame;
             REFERENCE_TIME rtTimePerSubFrame = m_rtTimePerSubFrame;
             m_bInvalidate = false;
             CComPtr<ISubPic> pSubPic;
+            ULONGLONG llContentHash = 0;
 
             REFERENCE_TIME rtStartRendering = GetCurrentRenderingTime();
             POSITION pos = pSubPicProvider->GetStartPosition(rtStartRendering, fps);
@@ -580,6 +769,8 @@ DWORD CSubPicQueue::ThreadProc()
                             break;
                         }
 
+                        REFERENCE_TIME rtRenderStart = GetPerfCounter();
+
                         REFERENCE_TIME rtStopReal;
                         if (rtStop == ISubPicProvider::UNKNOWN_TIME) { // Special case for subtitles with unknown end time
                             // Force a one frame duration
@@ -592,7 +783,7 @@ DWORD CSubPicQueue::ThreadProc()
                         if (bIsAnimated) {
                             // 3/4 is a magic number we use to avoid reusing the wrong frame due to slight
                             // misprediction of the frame end time
-                            hr = RenderTo(pStatic, rtCurrent, std::min(rtCurrent + rtTimePerSubFrame * 3 / 4, rtStopReal), fps, bIsAnimated);
+                            hr = RenderTo(pStatic, pSubPicProvider, rtCurrent, std::min(rtCurrent + rtTimePerSubFrame * 3 / 4, rtStopReal), fps, bIsAnimated, &llContentHash);
                             // Set the segment start and stop timings
                             pStatic->SetSegmentStart(rtStart);
                             // The stop timing can be moved so that the duration from the current start time
@@ -603,7 +794,7 @@ DWORD CSubPicQueue::ThreadProc()
                             pStatic->SetSegmentStop(std::max(rtCurrent + rtTimePerFrame, rtStopReal));
                             rtCurrent = std::min(rtCurrent + rtTimePerSubFrame, rtStopReal);
                         } else {
-                            hr = RenderTo(pStatic, rtStart, rtStopReal, fps, bIsAnimated);
+                            hr = RenderTo(pStatic, pSubPicProvider, rtStart, rtStopReal, fps, bIsAnimated, &llContentHash);
                             // Non-animated subtitles aren't part of a segment
                             pStatic->SetSegmentStart(ISubPic::INVALID_TIME);
                             pStatic->SetSegmentStop(ISubPic::INVALID_TIME);
@@ -623,22 +814,56 @@ DWORD CSubPicQueue::ThreadProc()
                               r.Width(), r.Height());
 #endif
 
+                        RelativeTo relativeTo;
+                        bool bHasRelativeTo = SUCCEEDED(pSubPicProvider->GetRelativeTo(pos, relativeTo));
+
+                        // The placement of the subpic is part of its content
+                        if (llContentHash != NO_CONTENT_HASH) {
+                            if (SUCCEEDED(hr2)) {
+                                llContentHash = HashCombine(llContentHash, ULONGLONG(virtualSize.cx) << 32 | DWORD(virtualSize.cy));
+                                llContentHash = HashCombine(llContentHash, ULONGLONG(virtualTopLeft.x) << 32 | DWORD(virtualTopLeft.y));
+                            }
+                            if (bHasRelativeTo) {
+                                llContentHash = HashCombine(llContentHash, ULONGLONG(relativeTo) + 1);
+                            }
+                        }
+
+                        // The subpic was rendered even if it ends up being merged
+                        REFERENCE_TIME rtRenderDuration = GetPerfCounter() - rtRenderStart;
+                        UpdateTelemetry([rtRenderDuration](SubPicQueueTelemetry& telemetry) {
+                            telemetry.renderDuration.AddSample(rtRenderDuration);
+                        });
+
+                        // Nothing changed since the previous subpic, just make it last longer
+                        if (pLastSubPic && llContentHash != NO_CONTENT_HASH && llContentHash == llLastContentHash
+                                && ExtendSubPic(pLastSubPic, pStatic)) {
+                            UpdateTelemetry([](SubPicQueueTelemetry& telemetry) {
+                                telemetry.nMerged++;
+                            });
+                            continue;
+                        }
+
                         pSubPic.Release();
                         if (FAILED(m_pAllocator->AllocDynamic(&pSubPic))
                                 || FAILED(pStatic->CopyTo(pSubPic))) {
                             break;
                         }
 
+                        UpdateTelemetry([](SubPicQueueTelemetry& telemetry) {
+                            telemetry.nRendered++;
+                        });
+
                         if (SUCCEEDED(hr2)) {
                             pSubPic->SetVirtualTextureSize(virtualSize, virtualTopLeft);
                         }
 
-                        RelativeTo relativeTo;
-                        if (SUCCEEDED(pSubPicProvider->GetRelativeTo(pos, relativeTo))) {
+                        if (bHasRelativeTo) {
                             pSubPic->SetRelativeTo(relativeTo);
                         }
 
                         // Try to enqueue the subpic, if the queue is full stop rendering
+                        pLastSubPic = pSubPic;
+                        llLastContentHash = llContentHash;
                         if (!EnqueueSubPic(pSubPic, false)) {
                             bStopRendering = true;
                             break;
@@ -748,8 +973,14 @@ STDMETHODIMP_(bool) CSubPicQueueNoThread::LookupSubPic(REFERENCE_TIME rtNow, boo
         ppSubPic = pSubPic;
     } else {
         CComPtr<ISubPicProvider> pSubPicProvider;
+        REFERENCE_TIME rtLockStart = GetPerfCounter();
         if (SUCCEEDED(GetSubPicProvider(&pSubPicProvider)) && pSubPicProvider
                 && SUCCEEDED(pSubPicProvider->Lock())) {
+            REFERENCE_TIME rtLockWait = GetPerfCounter() - rtLockStart;
+            UpdateTelemetry([rtLockWait](SubPicQueueTelemetry& telemetry) {
+                telemetry.providerLockWait.AddSample(rtLockWait);
+            });
+
             double fps = m_fps;
             POSITION pos = pSubPicProvider->GetStartPosition(rtNow, fps);
             if (pos) {
@@ -796,6 +1027,8 @@ STDMETHODIMP_(bool) CSubPicQueueNoThread::LookupSubPic(REFERENCE_TIME rtNow, boo
                         pSubPic = m_pSubPic;
                     }
 
+                    REFERENCE_TIME rtRenderStart = GetPerfCounter();
+
                     if (m_pAllocator->IsDynamicWriteOnly()) {
                         CComPtr<ISubPic> pStatic;
                         if (SUCCEEDED(m_pAllocator->GetStatic(&pStatic))
@@ -810,6 +1043,12 @@ STDMETHODIMP_(bool) CSubPicQueueNoThread::LookupSubPic(REFERENCE_TIME rtNow, boo
                     }
 
                     if (ppSubPic) {
+                        REFERENCE_TIME rtRenderDuration = GetPerfCounter() - rtRenderStart;
+                        UpdateTelemetry([rtRenderDuration](SubPicQueueTelemetry& telemetry) {
+                            telemetry.nRendered++;
+                            telemetry.renderDuration.AddSample(rtRenderDuration);
+                        });
+
                         if (SUCCEEDED(hr)) {
                             ppSubPic->SetVirtualTextureSize(virtualSize, virtualTopLeft);
                         }
@@ -826,6 +1065,15 @@ STDMETHODIMP_(bool) CSubPicQueueNoThread::LookupSubPic(REFERENCE_TIME rtNow, boo
         }
     }
 
+    UpdateTelemetry([&ppSubPic](SubPicQueueTelemetry& telemetry) {
+        telemetry.nLookups++;
+        if (ppSubPic) {
+            telemetry.nPresented++;
+        } else {
+            telemetry.nLookupMisses++;
+        }
+    });
+
     return !!ppSubPic;
 }
 
@@ -28,7 +28,7 @@
 #include "ISubPic.h"
 #include "SubPicQueueSettings.h"
 
-class CSubPicQueueImpl : public CUnknown, public ISubPicQueue
+class CSubPicQueueImpl : public CUnknown, public ISubPicQueue, public ISubPicQueueTelemetry
 {
     static const double DEFAULT_FPS;
 
@@ -85,6 +85,11 @@ protected:
 private:
     CCritSec m_csSubPicProvider;
     std::shared_ptr<SubPicProviderWithSharedLock> m_pSubPicProviderWithSharedLock;
+    std::shared_ptr<SubPicProviderWithSharedLock> m_pSnapshotWithSharedLock;
+
+    LARGE_INTEGER m_llPerfFrequency;
+    std::mutex m_mutexTelemetry; // to protect m_telemetry
+    SubPicQueueTelemetry m_telemetry;
 
 protected:
     double m_fps;
@@ -101,7 +106,33 @@ protected:
         return m_pSubPicProviderWithSharedLock;
     }
 
+    // Returns the latest snapshot of the subpic provider if it supports ISubPicProviderSnapshot,
+    // the subpic provider itself otherwise
+    std::shared_ptr<SubPicProviderWithSharedLock> GetSubPicProviderSnapshotWithSharedLock();
+
     HRESULT RenderTo(ISubPic* pSubPic, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop, double fps, BOOL bIsAnimated);
+    // pContentHash optionally receives a hash of the rendered pixels, it can be used to detect identical subpics
+    HRESULT RenderTo(ISubPic* pSubPic, ISubPicProvider* pSubPicProvider, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop, double fps, BOOL bIsAnimated, ULONGLONG* pContentHash = nullptr);
+
+    // Returns the performance counter in 100ns units
+    REFERENCE_TIME GetPerfCounter() const;
+
+    // xxHash64 round, used to detect identical subpics. A multiply alone only carries
+    // the differences upward, the rotation brings the high bits back down.
+    static ULONGLONG HashCombine(ULONGLONG hash, ULONGLONG value) {
+        hash += value * 0xc2b2ae3d27d4eb4full;
+        hash = _rotl64(hash, 31);
+        return hash * 0x9e3779b185ebca87ull;
+    }
+    // Returned when the pixels can't be hashed, such subpics are never merged
+    static const ULONGLONG NO_CONTENT_HASH = 0;
+    static ULONGLONG HashSubPicContent(const SubPicDesc& spd, const CRect& r);
+
+    template<typename F>
+    void UpdateTelemetry(F update) {
+        std::lock_guard<std::mutex> lock(m_mutexTelemetry);
+        update(m_telemetry);
+    }
 
 public:
     CSubPicQueueImpl(SubPicQueueSettings settings, ISubPicAllocator* pAllocator, HRESULT* phr);
@@ -125,6 +156,11 @@ public:
     STDMETHODIMP GetStats(int& nSubPics, REFERENCE_TIME& rtNow, REFERENCE_TIME& rtStart, REFERENCE_TIME& rtStop) PURE;
     STDMETHODIMP GetStats(int nSubPics, REFERENCE_TIME& rtStart, REFERENCE_TIME& rtStop) PURE;
     */
+
+    // ISubPicQueueTelemetry
+
+    STDMETHODIMP GetTelemetry(SubPicQueueTelemetry& telemetry);
+    STDMETHODIMP ResetTelemetry();
 };
 
 class CSubPicQueue : public CSubPicQueueImpl, protected CAMThread
@@ -134,6 +170,7 @@ protected:
 
     CComPtr<ISubPic> m_pSubPic;
     CInterfaceList<ISubPic> m_queue;
+    CAtlList<REFERENCE_TIME> m_queueEnqueueTimes; // enqueue time of each subpic in m_queue, for telemetry
 
     std::mutex m_mutexSubpic; // to protect m_pSubPic
     std::mutex m_mutexQueue; // to protect m_queue
@@ -148,6 +185,7 @@ protected:
     REFERENCE_TIME m_rtInvalidate;
 
     bool EnqueueSubPic(CComPtr<ISubPic>& pSubPic, bool bBlocking);
+    bool ExtendSubPic(ISubPic* pLastSubPic, ISubPic* pSubPic);
     REFERENCE_TIME GetCurrentRenderingTime();
 
     // CAMThread
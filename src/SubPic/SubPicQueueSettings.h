@@ -29,16 +29,18 @@ struct SubPicQueueSettings {
     int  nRenderAtWhenAnimationIsDisabled;
     int  nAnimationRate;
     bool bAllowDroppingSubpic;
+    bool bCompressQueuedSubpics;
 
     SubPicQueueSettings(int nSize, int nMaxRes,
                         bool bDisableSubtitleAnimation, int nRenderAtWhenAnimationIsDisabled, int nAnimationRate,
-                        bool bAllowDroppingSubpic)
+                        bool bAllowDroppingSubpic, bool bCompressQueuedSubpics = false)
         : nSize(nSize)
         , nMaxRes(nMaxRes)
         , bDisableSubtitleAnimation(bDisableSubtitleAnimation)
         , nRenderAtWhenAnimationIsDisabled(nRenderAtWhenAnimationIsDisabled)
         , nAnimationRate(nAnimationRate)
         , bAllowDroppingSubpic(bAllowDroppingSubpic)
+        , bCompressQueuedSubpics(bCompressQueuedSubpics)
     {};
 
     SubPicQueueSettings()
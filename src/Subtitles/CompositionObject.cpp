@@ -56,6 +56,7 @@ CompositionObject::CompositionObject(const CompositionObject& obj)
 
 CompositionObject::~CompositionObject()
 {
+    WaitForDecoding();
     delete [] m_pRLEData;
 }
 
@@ -79,10 +80,21 @@ void CompositionObject::Init()
 
 void CompositionObject::Reset()
 {
+    WaitForDecoding();
+    m_decoding = std::future<void>();
+    m_paletteIndexes.clear();
+
     delete[] m_pRLEData;
     Init();
 }
 
+void CompositionObject::WaitForDecoding()
+{
+    if (m_decoding.valid()) {
+        m_decoding.wait();
+    }
+}
+
 void CompositionObject::SetPalette(int nNbEntry, const HDMV_PALETTE* pPalette, ColorConvTable::YuvMatrixType currentMatrix)
 {
     m_nColorNumber = nNbEntry;
@@ -93,6 +105,10 @@ void CompositionObject::SetPalette(int nNbEntry, const HDMV_PALETTE* pPalette, C
 
 void CompositionObject::SetRLEData(const BYTE* pBuffer, size_t nSize, size_t nTotalSize)
 {
+    WaitForDecoding();
+    m_decoding = std::future<void>();
+    m_paletteIndexes.clear();
+
     delete [] m_pRLEData;
 
     if (nTotalSize > 0 && nSize <= nTotalSize) {
@@ -118,20 +134,58 @@ void CompositionObject::AppendRLEData(const BYTE* pBuffer, size_t nSize)
     }
 }
 
+void CompositionObject::StartHdmvDecoding()
+{
+    if (m_pRLEData && m_width > 0 && m_height > 0 && !m_decoding.valid()) {
+        m_decoding = std::async(std::launch::async, [this] { DecodeHdmv(); });
+    }
+}
+
 void CompositionObject::RenderHdmv(SubPicDesc& spd)
 {
     if (!m_pRLEData || !m_nColorNumber) {
         return;
     }
 
+    if (m_decoding.valid()) {
+        m_decoding.wait();
+    } else if (m_paletteIndexes.empty()) {
+        DecodeHdmv();
+    }
+
+    if (m_paletteIndexes.size() != size_t(m_width * m_height)) {
+        return;
+    }
+
+    // Consecutive pixels using the same palette entry are drawn as a single run
+    for (LONG y = 0; y < m_height; y++) {
+        const BYTE* pIndexes = &m_paletteIndexes[y * m_width];
+
+        for (LONG x = 0, nCount; x < m_width; x += nCount) {
+            BYTE nPaletteIndex = pIndexes[x];
+            for (nCount = 1; x + nCount < m_width && pIndexes[x + nCount] == nPaletteIndex; nCount++) {
+                ;
+            }
+
+            if (nPaletteIndex != 0xFF) {    // Fully transparent (section 9.14.4.2.2.1.1)
+                FillSolidRect(spd, m_horizontal_position + x, m_vertical_position + y, nCount, 1, m_colors[nPaletteIndex]);
+            }
+        }
+    }
+}
+
+void CompositionObject::DecodeHdmv()
+{
+    m_paletteIndexes.assign(m_width * m_height, 0xFF);
+
     CGolombBuffer GBuffer(m_pRLEData, m_nRLEDataSize);
     BYTE  bSwitch;
     BYTE  nPaletteIndex = 0;
     LONG nCount;
-    LONG nX = m_horizontal_position;
-    LONG nY = m_vertical_position;
+    LONG nX = 0;
+    LONG nY = 0;
 
-    while ((nY < (m_vertical_position + m_height)) && !GBuffer.IsEOF()) {
+    while ((nY < m_height) && !GBuffer.IsEOF()) {
         BYTE bTemp = GBuffer.ReadByte();
         if (bTemp != 0) {
             nPaletteIndex = bTemp;
@@ -160,13 +214,13 @@ void CompositionObject::RenderHdmv(SubPicDesc& spd)
         }
 
         if (nCount > 0) {
-            if (nPaletteIndex != 0xFF) {    // Fully transparent (section 9.14.4.2.2.1.1)
-                FillSolidRect(spd, nX, nY, nCount, 1, m_colors[nPaletteIndex]);
+            if (nPaletteIndex != 0xFF && nX < m_width) {
+                memset(&m_paletteIndexes[nY * m_width + nX], nPaletteIndex, std::min(nCount, m_width - nX));
             }
             nX += nCount;
         } else {
             nY++;
-            nX = m_horizontal_position;
+            nX = 0;
         }
     }
 }
@@ -188,6 +242,16 @@ void CompositionObject::RenderDvb(SubPicDesc& spd, short nX, short nY)
     DvbRenderField(spd, gb, nX, nY + 1, sBottomFieldLength);
 }
 
+void CompositionObject::WriteSeg(SubPicDesc& spd, short nX, short nY, short nCount, short nPaletteIndex)
+{
+    // Clip the run so that a corrupted object cannot write outside of the picture
+    if (nX < 0 || nY < 0 || nX >= spd.w || nY >= spd.h) {
+        return;
+    }
+
+    FillSolidRect(spd, nX, nY, std::min<int>(nCount, spd.w - nX), 1, m_colors[nPaletteIndex]);
+}
+
 void CompositionObject::DvbRenderField(SubPicDesc& spd, CGolombBuffer& gb, short nXStart, short nYStart, short nLength)
 {
     //FillSolidRect(spd, nXStart, nYStart, m_width, m_height, 0xFFFF0000);  // Red opaque
@@ -276,7 +340,7 @@ void CompositionObject::Dvb2PixelsCodeString(SubPicDesc& spd, CGolombBuffer& gb,
         }
 
         if (nCount > 0) {
-            FillSolidRect(spd, nX, nY, nCount, 1, m_colors[nPaletteIndex]);
+            WriteSeg(spd, nX, nY, nCount, nPaletteIndex);
             nX += nCount;
         }
     }
@@ -329,7 +393,7 @@ void CompositionObject::Dvb4PixelsCodeString(SubPicDesc& spd, CGolombBuffer& gb,
         }
 
         if (nCount > 0) {
-            FillSolidRect(spd, nX, nY, nCount, 1, m_colors[nPaletteIndex]);
+            WriteSeg(spd, nX, nY, nCount, nPaletteIndex);
             nX += nCount;
         }
     }
@@ -361,7 +425,7 @@ void CompositionObject::Dvb8PixelsCodeString(SubPicDesc& spd, CGolombBuffer& gb,
         }
 
         if (nCount > 0) {
-            FillSolidRect(spd, nX, nY, nCount, 1, m_colors[nPaletteIndex]);
+            WriteSeg(spd, nX, nY, nCount, nPaletteIndex);
             nX += nCount;
         }
     }
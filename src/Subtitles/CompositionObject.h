@@ -22,6 +22,8 @@
 
 #include "Rasterizer.h"
 #include "ColorConvTable.h"
+#include <vector>
+#include <future>
 
 
 struct HDMV_PALETTE {
@@ -66,6 +68,9 @@ public:
     size_t GetRLEDataSize() const { return m_nRLEDataSize; };
     size_t GetRLEPos() const { return m_nRLEPos; };
     bool IsRLEComplete() const { return m_nRLEPos >= m_nRLEDataSize; };
+    // Decodes the HDMV RLE data to palette indexes on a worker thread, so that
+    // RenderHdmv only has to apply the palette
+    void StartHdmvDecoding();
     void RenderHdmv(SubPicDesc& spd);
     void RenderDvb(SubPicDesc& spd, short nX, short nY);
     void WriteSeg(SubPicDesc& spd, short nX, short nY, short nCount, short nPaletteIndex);
@@ -85,6 +90,12 @@ private:
     int m_nColorNumber;
     std::array<DWORD, 256> m_colors;
 
+    std::vector<BYTE> m_paletteIndexes; // m_width x m_height, 0xFF is transparent
+    std::future<void> m_decoding;
+
+    void  DecodeHdmv();
+    void  WaitForDecoding();
+
     void  DvbRenderField(SubPicDesc& spd, CGolombBuffer& gb, short nXStart, short nYStart, short nLength);
     void  Dvb2PixelsCodeString(SubPicDesc& spd, CGolombBuffer& gb, short& nX, short& nY);
     void  Dvb4PixelsCodeString(SubPicDesc& spd, CGolombBuffer& gb, short& nX, short& nY);
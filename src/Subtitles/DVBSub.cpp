@@ -56,17 +56,19 @@ STDMETHODIMP_(POSITION) CDVBSub::GetStartPosition(REFERENCE_TIME rt, double fps)
 {
     CAutoLock cAutoLock(&m_csCritSec);
 
-    POSITION pos = m_pages.GetHeadPosition();
-    while (pos) {
-        const auto& pPage = m_pages.GetAt(pos);
-        if (pPage->rtStop <= rt) {
-            m_pages.GetNext(pos);
-        } else {
-            break;
+    // The pages don't overlap so either one of the last pages starting
+    // before rt, which all start at the same time, is still displayed
+    // or the next one is the first
+    auto it = m_pageIndex.upper_bound(rt);
+    if (it != m_pageIndex.cbegin()) {
+        for (auto itPage = m_pageIndex.lower_bound(std::prev(it)->first); itPage != it; ++itPage) {
+            if (m_pages.GetAt(itPage->second)->rtStop > rt) {
+                return itPage->second;
+            }
         }
     }
 
-    return pos;
+    return (it != m_pageIndex.cend()) ? it->second : nullptr;
 }
 
 STDMETHODIMP_(POSITION) CDVBSub::GetNext(POSITION pos)
@@ -114,27 +116,17 @@ STDMETHODIMP CDVBSub::Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, REC
                 auto itCLUT = FindClut(pPage, pRegion->CLUT_id);
 
                 if (itCLUT != pPage->CLUTs.cend()) {
-                    const auto& pCLUT = *itCLUT;
-
-                    size_t nObject = 1;
-                    for (const auto& objectPos : pRegion->objects) {
-                        auto itObject = FindObject(pPage, objectPos.object_id);
-
-                        if (itObject != pPage->objects.cend()) {
-                            const auto& pObject = *itObject;
-
-                            short nX = regionPos.horizAddr + objectPos.object_horizontal_position;
-                            short nY = regionPos.vertAddr + objectPos.object_vertical_position;
-                            pObject->m_width = pRegion->width;
-                            pObject->m_height = pRegion->height;
-                            pObject->SetPalette(pCLUT->size, pCLUT->palette.data(), m_eSourceMatrix);
-                            pObject->RenderDvb(spd, nX, nY);
-
-                            TRACE_DVB(_T(" --> %Iu/%Iu - %Iu/%Iu\n"), nRegion, pPage->regionsPos.size(), nObject, pRegion->objects.size());
-                        }
-
-                        nObject++;
+                    const DVB_REGION_BITMAP& bitmap = GetRegionBitmap(pPage, *pRegion, **itCLUT);
+
+                    // The regions don't overlap so the pre-rendered bitmap can simply be copied
+                    int nWidth = std::min(int(bitmap.width), spd.w - regionPos.horizAddr);
+                    int nHeight = std::min(int(bitmap.height), spd.h - regionPos.vertAddr);
+                    for (int y = 0; nWidth > 0 && y < nHeight; y++) {
+                        DWORD* pDst = (DWORD*)(spd.bits + spd.pitch * (regionPos.vertAddr + y)) + regionPos.horizAddr;
+                        memcpy(pDst, &bitmap.pixels[y * bitmap.width], nWidth * sizeof(DWORD));
                     }
+
+                    TRACE_DVB(_T(" --> %Iu/%Iu\n"), nRegion, pPage->regionsPos.size());
                 }
             }
 
@@ -372,6 +364,8 @@ void CDVBSub::Reset()
     m_nBufferWritePos = 0;
     m_pCurrentPage.Free();
     m_pages.RemoveAll();
+    m_pageIndex.clear();
+    m_regionBitmaps.clear();
 }
 
 HRESULT CDVBSub::AddToBuffer(BYTE* pData, size_t nSize)
@@ -411,15 +405,17 @@ HRESULT CDVBSub::AddToBuffer(BYTE* pData, size_t nSize)
 
 POSITION CDVBSub::FindPage(REFERENCE_TIME rt) const
 {
-    POSITION pos = m_pages.GetHeadPosition();
-
-    while (pos) {
-        POSITION currentPos = pos;
-        const auto& pPage = m_pages.GetNext(pos);
-
-        if (rt >= pPage->rtStart && rt < pPage->rtStop) {
-            return currentPos;
-        }
+    // The pages don't overlap so only the last pages starting before rt can be displayed,
+    // when several of them start at the same time the one which was received last wins
+    auto it = m_pageIndex.upper_bound(rt);
+    if (it != m_pageIndex.cbegin()) {
+        REFERENCE_TIME rtStart = std::prev(it)->first;
+        do {
+            POSITION pos = (--it)->second;
+            if (rt < m_pages.GetAt(pos)->rtStop) {
+                return pos;
+            }
+        } while (it != m_pageIndex.cbegin() && std::prev(it)->first == rtStart);
     }
 
     return nullptr;
@@ -449,6 +445,70 @@ CDVBSub::CompositionObjectList::const_iterator CDVBSub::FindObject(const CAutoPt
     [sObjectId](const std::unique_ptr<CompositionObject>& pObject) { return pObject->m_object_id_ref == sObjectId; });
 }
 
+const CDVBSub::DVB_REGION_BITMAP& CDVBSub::GetRegionBitmap(const CAutoPtr<DVB_PAGE>& pPage, const DVB_REGION& region, const DVB_CLUT& CLUT)
+{
+    // The content of the region is identified by the versions of everything it is made of
+    std::vector<DWORD> objects;
+    objects.reserve(region.objects.size() * 2);
+    for (const auto& objectPos : region.objects) {
+        auto itObject = FindObject(pPage, objectPos.object_id);
+        BYTE version = (itObject != pPage->objects.cend()) ? (*itObject)->m_version_number : 0xFF;
+        objects.push_back(DWORD(WORD(objectPos.object_id)) << 16 | version);
+        objects.push_back(DWORD(WORD(objectPos.object_horizontal_position)) << 16 | WORD(objectPos.object_vertical_position));
+    }
+
+    auto itBitmap = std::find_if(m_regionBitmaps.begin(), m_regionBitmaps.end(), [&](const DVB_REGION_BITMAP& bitmap) {
+        return bitmap.regionId == region.id;
+    });
+
+    if (itBitmap == m_regionBitmaps.end()) {
+        m_regionBitmaps.emplace_back();
+        itBitmap = std::prev(m_regionBitmaps.end());
+    } else if (itBitmap->regionVersion == region.version_number
+               && itBitmap->CLUTId == CLUT.id && itBitmap->CLUTVersion == CLUT.version_number
+               && itBitmap->width == region.width && itBitmap->height == region.height
+               && itBitmap->matrix == m_eSourceMatrix && itBitmap->objects == objects) {
+        return *itBitmap;
+    }
+
+    // The region changed or the color matrix did, replace its bitmap
+    DVB_REGION_BITMAP& bitmap = *itBitmap;
+    bitmap.regionId = region.id;
+    bitmap.regionVersion = region.version_number;
+    bitmap.CLUTId = CLUT.id;
+    bitmap.CLUTVersion = CLUT.version_number;
+    bitmap.objects = std::move(objects);
+    bitmap.matrix = m_eSourceMatrix;
+    bitmap.width = region.width;
+    bitmap.height = region.height;
+    // Same transparent color the subpics are cleared with
+    bitmap.pixels.assign(size_t(region.width) * region.height, 0xFF000000);
+
+    SubPicDesc spd;
+    spd.w = region.width;
+    spd.h = region.height;
+    spd.bpp = 32;
+    spd.pitch = spd.w * 4;
+    spd.bits = (BYTE*)bitmap.pixels.data();
+
+    for (const auto& objectPos : region.objects) {
+        auto itObject = FindObject(pPage, objectPos.object_id);
+
+        if (itObject != pPage->objects.cend()) {
+            const auto& pObject = *itObject;
+
+            pObject->m_width = region.width;
+            pObject->m_height = region.height;
+            pObject->SetPalette(CLUT.size, CLUT.palette.data(), m_eSourceMatrix);
+            pObject->RenderDvb(spd, objectPos.object_horizontal_position, objectPos.object_vertical_position);
+        }
+    }
+
+    TRACE_DVB(_T("DVB - Rendered region %d (version %d) %dx%d\n"), region.id, region.version_number, region.width, region.height);
+
+    return bitmap;
+}
+
 HRESULT CDVBSub::ParsePage(CGolombBuffer& gb, WORD wSegLength, CAutoPtr<DVB_PAGE>& pPage)
 {
     size_t nExpectedSize = 2;
@@ -653,7 +713,8 @@ HRESULT CDVBSub::EnqueuePage(REFERENCE_TIME rtStop)
         m_pCurrentPage->rtStop = rtStop;
     }
     TRACE_DVB(_T("DVB - Enqueue page %s (%s - %s)\n"), ReftimeToString(rtStop), ReftimeToString(m_pCurrentPage->rtStart), ReftimeToString(m_pCurrentPage->rtStop));
-    m_pages.AddTail(m_pCurrentPage);
+    REFERENCE_TIME rtStart = m_pCurrentPage->rtStart;
+    m_pageIndex.emplace(rtStart, m_pages.AddTail(m_pCurrentPage));
 
     return S_OK;
 }
@@ -689,6 +750,13 @@ void CDVBSub::RemoveOldPages(REFERENCE_TIME rt)
             TRACE_DVB(_T("DVB - remove unrendered object, %s - %s\n"),
                       ReftimeToString(pPage->rtStart), ReftimeToString(pPage->rtStop));
         }
+        auto range = m_pageIndex.equal_range(pPage->rtStart);
+        auto it = std::find_if(range.first, range.second, [this](const std::pair<const REFERENCE_TIME, POSITION>& page) {
+            return page.second == m_pages.GetHeadPosition();
+        });
+        if (it != range.second) {
+            m_pageIndex.erase(it);
+        }
         m_pages.RemoveHeadNoReturn();
     }
 }
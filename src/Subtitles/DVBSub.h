@@ -23,7 +23,9 @@
 #include "RLECodedSubtitle.h"
 #include "CompositionObject.h"
 #include <list>
+#include <map>
 #include <memory>
+#include <vector>
 
 class CGolombBuffer;
 
@@ -131,6 +133,20 @@ private:
     using CompositionObjectList = std::list<std::unique_ptr<CompositionObject>>;
     using ClutList = std::list<std::unique_ptr<DVB_CLUT>>;
 
+    // Pre-rendered region. The broadcasters send the unchanged regions again with
+    // the same version numbers, so the bitmap can be reused by the next pages.
+    struct DVB_REGION_BITMAP {
+        BYTE  regionId = 0;
+        BYTE  regionVersion = 0;
+        BYTE  CLUTId = 0;
+        BYTE  CLUTVersion = 0;
+        std::vector<DWORD> objects; // id, version and position of each object
+        ColorConvTable::YuvMatrixType matrix = ColorConvTable::NONE;
+        WORD  width = 0;
+        WORD  height = 0;
+        std::vector<DWORD> pixels;
+    };
+
     class DVB_PAGE
     {
     public:
@@ -151,6 +167,10 @@ private:
     size_t                 m_nBufferWritePos;
     BYTE*                  m_pBuffer;
     CAutoPtrList<DVB_PAGE> m_pages;
+    std::multimap<REFERENCE_TIME, POSITION> m_pageIndex; // pages ordered by start time, then by arrival
+    // Latest bitmap of each region, the version numbers wrap around quickly
+    // so only the most recent content of a region can be matched safely
+    std::list<DVB_REGION_BITMAP> m_regionBitmaps;
     CAutoPtr<DVB_PAGE>     m_pCurrentPage;
     DVB_DISPLAY            m_displayInfo;
 
@@ -161,6 +181,8 @@ private:
     ClutList::const_iterator   FindClut(const CAutoPtr<DVB_PAGE>& pPage, BYTE bClutId) const;
     CompositionObjectList::const_iterator FindObject(const CAutoPtr<DVB_PAGE>& pPage, short sObjectId) const;
 
+    const DVB_REGION_BITMAP& GetRegionBitmap(const CAutoPtr<DVB_PAGE>& pPage, const DVB_REGION& region, const DVB_CLUT& CLUT);
+
     HRESULT  ParsePage(CGolombBuffer& gb, WORD wSegLength, CAutoPtr<DVB_PAGE>& pPage);
     HRESULT  ParseDisplay(CGolombBuffer& gb, WORD wSegLength);
     HRESULT  ParseRegion(CGolombBuffer& gb, WORD wSegLength);
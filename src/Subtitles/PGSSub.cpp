@@ -325,6 +325,8 @@ void CPGSSub::EnqueuePresentationSegment()
 
                 if (pObjectData.GetRLEData()) {
                     pObject->SetRLEData(pObjectData.GetRLEData(), pObjectData.GetRLEPos(), pObjectData.GetRLEDataSize());
+                    // Decode the object now so that rendering it is cheap
+                    pObject->StartHdmvDecoding();
                 }
             }
 
@@ -476,17 +478,49 @@ void CPGSSub::RemoveOldSegments(REFERENCE_TIME rt)
 CPGSSubFile::CPGSSubFile(CCritSec* pLock)
     : CPGSSub(pLock, _T("PGS External Subtitle"), 0)
     , m_bStopParsing(false)
+    , m_bResetPending(false)
+    , m_rtRequested(0)
 {
 }
 
 CPGSSubFile::~CPGSSubFile()
 {
-    m_bStopParsing = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mutexParsing);
+        m_bStopParsing = true;
+    }
+    m_parsingCV.notify_one();
     if (m_parsingThread.joinable()) {
         m_parsingThread.join();
     }
 }
 
+STDMETHODIMP_(POSITION) CPGSSubFile::GetStartPosition(REFERENCE_TIME rt, double fps)
+{
+    {
+        // Let the parsing thread follow the playback position. Small moves
+        // are ignored so that it isn't woken up for every call.
+        std::lock_guard<std::mutex> lock(m_mutexParsing);
+        if (std::abs(rt - m_rtRequested) >= 10000000i64) {
+            m_rtRequested = rt;
+            m_parsingCV.notify_one();
+        }
+        if (m_bResetPending) {
+            Reset();
+            m_bResetPending = false;
+            m_parsingCV.notify_one();
+        }
+    }
+
+    // The caller holds the provider lock and has no position yet, it's safe to remove segments
+    {
+        CAutoLock cAutoLock(&m_csCritSec);
+        RemoveOldSegments(rt);
+    }
+
+    return __super::GetStartPosition(rt, fps);
+}
+
 STDMETHODIMP CPGSSubFile::Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox)
 {
     return __super::Render(spd, rt, bbox, false);
@@ -518,17 +552,111 @@ bool CPGSSubFile::Open(CString fn, CString name /*= _T("")*/, CString videoName
 
 void CPGSSubFile::ParseFile(CString fn)
 {
+    SetThreadName(DWORD(-1), "PGS File Parser Thread");
+
     CFile f;
-    if (!f.Open(fn, CFile::modeRead | CFile::shareDenyWrite)) {
+    if (!f.Open(fn, CFile::modeRead | CFile::shareDenyWrite) || !IndexFile(f)) {
         return;
     }
 
+    // Only the display sets between nParsedFirst and nParsedEnd (excluded)
+    // are in memory, they are parsed on demand around the playback position
+    size_t nParsedFirst = 0, nParsedEnd = 0;
+
+    std::unique_lock<std::mutex> lock(m_mutexParsing);
+    while (!m_bStopParsing) {
+        REFERENCE_TIME rt = m_rtRequested;
+        lock.unlock();
+
+        size_t nCurrent = FindDisplaySet(rt);
+        size_t nEnd = FindDisplaySet(rt + PARSE_AHEAD) + 1;
+
+        if (nCurrent < nParsedFirst || nCurrent > nParsedEnd) {
+            // We are too far from what was parsed so far, restart
+            // from the closest random access point before rt
+            size_t nStart = nCurrent;
+            while (nStart > 0 && !m_displaySets[nStart].bRandomAccess) {
+                nStart--;
+            }
+            TRACE_PGSSUB(_T("CPGSSubFile::ParseFile Seeking to display set %Iu (rt=%s)\n"), nStart, ReftimeToString(rt));
+            lock.lock();
+            m_bResetPending = true;
+            m_parsingCV.wait(lock, [&] { return m_bStopParsing || !m_bResetPending; });
+            if (m_bStopParsing) {
+                break;
+            }
+            lock.unlock();
+            nParsedFirst = nParsedEnd = nStart;
+        }
+
+        if (nEnd > nParsedEnd) {
+            ParseDisplaySets(f, nParsedEnd, nEnd);
+            nParsedEnd = nEnd;
+        }
+
+        // GetStartPosition removes the old segments but keeps a 2 min buffer
+        nParsedFirst = std::max(nParsedFirst, FindDisplaySet(rt - 120 * 10000000i64));
+
+        lock.lock();
+        m_parsingCV.wait(lock, [&] { return m_bStopParsing || m_rtRequested != rt; });
+    }
+}
+
+bool CPGSSubFile::IndexFile(CFile& f)
+{
+    // Header: Sync code | start time | stop time | segment type | segment size
+    std::array < BYTE, 2 + 2 * 4 + 1 + 2 > header;
+    // Presentation segment: video descriptor | composition descriptor
+    std::array < BYTE, 5 + 3 > presentation;
+
+    std::vector<DISPLAY_SET> displaySets;
+    ULONGLONG nPos = 0;
+
+    // Only the headers are read so that large files can be indexed quickly
+    while (!m_bStopParsing && f.Seek(nPos, CFile::begin) == nPos
+            && f.Read(header.data(), (UINT)header.size()) == header.size()) {
+        CGolombBuffer headerBuffer(header.data(), (int)header.size());
+
+        if (WORD(headerBuffer.ReadShort()) != PGS_SYNC_CODE) {
+            break;
+        }
+
+        REFERENCE_TIME rtStart = REFERENCE_TIME(headerBuffer.ReadDword()) * 1000 / 9;
+        headerBuffer.ReadDword(); // stop time
+        BYTE segType = headerBuffer.ReadByte();
+        WORD wLenSegment = (WORD)headerBuffer.ReadShort();
+
+        if (segType == PRESENTATION_SEG && wLenSegment >= presentation.size()) {
+            if (f.Read(presentation.data(), (UINT)presentation.size()) != presentation.size()) {
+                break;
+            }
+            // composition_state: 0 = normal, 1 = acquisition point, 2 = epoch start
+            DISPLAY_SET displaySet = { nPos, rtStart, (presentation[7] >> 6) != 0 };
+            displaySets.push_back(displaySet);
+        }
+
+        nPos += header.size() + wLenSegment;
+    }
+
+    TRACE_PGSSUB(_T("CPGSSubFile::IndexFile %Iu display sets\n"), displaySets.size());
+    m_displaySets.swap(displaySets);
+
+    return !m_displaySets.empty();
+}
+
+void CPGSSubFile::ParseDisplaySets(CFile& f, size_t nFirst, size_t nLast)
+{
     // Header: Sync code | start time | stop time | segment type | segment size
     std::array < BYTE, 2 + 2 * 4 + 1 + 2 > header;
     const int nExtraSize = 1 + 2; // segment type + segment size
     std::vector<BYTE> segBuff;
 
-    while (!m_bStopParsing && f.Read(header.data(), (UINT)header.size()) == header.size()) {
+    ULONGLONG nEndPos = (nLast < m_displaySets.size()) ? m_displaySets[nLast].nOffset : ULLONG_MAX;
+
+    f.Seek(m_displaySets[nFirst].nOffset, CFile::begin);
+
+    while (!m_bStopParsing && f.GetPosition() < nEndPos
+            && f.Read(header.data(), (UINT)header.size()) == header.size()) {
         // Parse the header
         CGolombBuffer headerBuffer(header.data(), (int)header.size());
 
@@ -552,8 +680,19 @@ void CPGSSubFile::ParseFile(CString fn)
         }
 
         // Parse the data (even if the segment size is 0 because the header itself is important)
-        TRACE_PGSSUB(_T("--------- CPGSSubFile::ParseFile rtStart=%s, rtStop=%s, len=%d ---------\n"),
+        TRACE_PGSSUB(_T("--------- CPGSSubFile::ParseDisplaySets rtStart=%s, rtStop=%s, len=%d ---------\n"),
                      ReftimeToString(rtStart), ReftimeToString(rtStop), nLenData);
         ParseSample(rtStart, rtStop, segBuff.data(), nLenData);
     }
 }
+
+size_t CPGSSubFile::FindDisplaySet(REFERENCE_TIME rt) const
+{
+    // Last display set starting at or before rt
+    auto it = std::upper_bound(m_displaySets.cbegin(), m_displaySets.cend(), rt,
+    [](REFERENCE_TIME rt, const DISPLAY_SET & displaySet) {
+        return rt < displaySet.rtStart;
+    });
+
+    return (it == m_displaySets.cbegin()) ? 0 : size_t(it - m_displaySets.cbegin()) - 1;
+}
@@ -23,6 +23,8 @@
 #include "RLECodedSubtitle.h"
 #include "CompositionObject.h"
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <list>
 #include <memory>
 
@@ -49,8 +51,8 @@ public:
 
 protected:
     HRESULT Render(SubPicDesc& spd, REFERENCE_TIME rt, RECT& bbox, bool bRemoveOldSegments);
+    void    RemoveOldSegments(REFERENCE_TIME rt);
 
-private:
     enum HDMV_SEGMENT_TYPE {
         NO_SEGMENT       = 0xFFFF,
         PALETTE          = 0x14,
@@ -63,7 +65,7 @@ private:
         HDMV_SUB2        = 0x82
     };
 
-
+private:
     struct VIDEO_DESCRIPTOR {
         int  nVideoWidth;
         int  nVideoHeight;
@@ -132,8 +134,6 @@ private:
     bool ParseCompositionObject(CGolombBuffer* pGBuffer, const std::unique_ptr<CompositionObject>& pCompositionObject);
 
     POSITION FindPresentationSegment(REFERENCE_TIME rt) const;
-
-    void RemoveOldSegments(REFERENCE_TIME rt);
 };
 
 class CPGSSubFile : public CPGSSub
@@ -143,15 +143,35 @@ public:
     virtual ~CPGSSubFile();
 
     // ISubPicProvider
-    STDMETHODIMP Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox);
+    STDMETHODIMP_(POSITION) GetStartPosition(REFERENCE_TIME rt, double fps);
+    STDMETHODIMP            Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox);
 
     bool Open(CString fn, CString name = _T(""), CString videoName = _T(""));
 
 private:
     static const WORD PGS_SYNC_CODE = 'PG';
+    // How far ahead of the playback position the display sets are parsed
+    static const REFERENCE_TIME PARSE_AHEAD = 60 * 10000000i64;
+
+    struct DISPLAY_SET {
+        ULONGLONG      nOffset;       // position of the presentation segment in the file
+        REFERENCE_TIME rtStart;
+        bool           bRandomAccess; // epoch start or acquisition point, parsing can start from there
+    };
+
+    std::vector<DISPLAY_SET> m_displaySets;
 
     bool m_bStopParsing;
+    // The segments can only be removed while the provider is locked by the
+    // queue, so the parsing thread asks GetStartPosition to reset them
+    bool m_bResetPending;
+    REFERENCE_TIME m_rtRequested;
+    std::mutex m_mutexParsing;
+    std::condition_variable m_parsingCV;
     std::thread m_parsingThread;
 
-    void ParseFile(CString fn);
+    void   ParseFile(CString fn);
+    bool   IndexFile(CFile& f);
+    void   ParseDisplaySets(CFile& f, size_t nFirst, size_t nLast);
+    size_t FindDisplaySet(REFERENCE_TIME rt) const;
 };
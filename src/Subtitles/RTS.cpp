@@ -1553,6 +1553,8 @@ CRenderedTextSubtitle::CRenderedTextSubtitle(CCritSec* pLock)
     , m_bOverrideStyle(false)
     , m_bOverridePlacement(false)
     , m_overridePlacement(50, 90)
+    , m_nVersion(0)
+    , m_nSnapshotVersion(0)
 {
     m_size = CSize(0, 0);
 
@@ -1666,6 +1668,8 @@ void CRenderedTextSubtitle::OnChanged()
     m_subtitleCache.RemoveAll();
 
     m_sla.Empty();
+
+    m_nVersion++;
 }
 
 bool CRenderedTextSubtitle::Init(CSize size, const CRect& vidrect)
@@ -1696,6 +1700,8 @@ void CRenderedTextSubtitle::Deinit()
 
     m_size = CSize(0, 0);
     m_vidrect.SetRectEmpty();
+
+    m_nVersion++;
 }
 
 void CRenderedTextSubtitle::ParseEffect(CSubtitle* sub, CString str)
@@ -2846,6 +2852,7 @@ STDMETHODIMP CRenderedTextSubtitle::NonDelegatingQueryInterface(REFIID riid, voi
         QI(IPersist)
         QI(ISubStream)
         QI(ISubPicProvider)
+        QI(ISubPicProviderSnapshot)
         __super::NonDelegatingQueryInterface(riid, ppv);
 }
 
@@ -3294,3 +3301,38 @@ STDMETHODIMP CRenderedTextSubtitle::SetSourceTargetInfo(CString yuvVideoMatrix,
 
     return S_OK;
 }
+
+// ISubPicProviderSnapshot
+
+STDMETHODIMP CRenderedTextSubtitle::GetSnapshot(ISubPicProvider** ppSnapshot)
+{
+    CheckPointer(ppSnapshot, E_POINTER);
+    *ppSnapshot = nullptr;
+
+    CAutoLock cAutoLock(m_pLock);
+
+    if (!m_pSnapshot || m_nSnapshotVersion != m_nVersion) {
+        CRenderedTextSubtitle* pRTS = DEBUG_NEW CRenderedTextSubtitle(nullptr);
+        CComPtr<ISubPicProvider> pSnapshot = pRTS;
+        pRTS->m_pLock = &pRTS->m_csSnapshotLock;
+
+        pRTS->Copy(*this);
+        // Copy() only handles the script itself
+        pRTS->m_lcid = m_lcid;
+        pRTS->m_sYCbCrMatrix = m_sYCbCrMatrix;
+        pRTS->m_ePARCompensationType = m_ePARCompensationType;
+        pRTS->m_dPARCompensation = m_dPARCompensation;
+        pRTS->m_bOverrideStyle = m_bOverrideStyle;
+        pRTS->m_styleOverride = m_styleOverride;
+        pRTS->m_bOverridePlacement = m_bOverridePlacement;
+        pRTS->m_overridePlacement = m_overridePlacement;
+
+        m_pSnapshot = pSnapshot;
+        m_nSnapshotVersion = m_nVersion;
+    }
+
+    *ppSnapshot = m_pSnapshot;
+    (*ppSnapshot)->AddRef();
+
+    return S_OK;
+}
@@ -343,7 +343,7 @@ public:
 };
 
 class __declspec(uuid("537DCACA-2812-4a4f-B2C6-1A34C17ADEB0"))
-    CRenderedTextSubtitle : public CSimpleTextSubtitle, public CSubPicProviderImpl, public ISubStream
+    CRenderedTextSubtitle : public CSimpleTextSubtitle, public CSubPicProviderImpl, public ISubStream, public ISubPicProviderSnapshot
 {
     static CAtlMap<CStringW, SSATagCmd, CStringElementTraits<CStringW>> s_SSATagCmds;
     CAtlMap<int, CSubtitle*> m_subtitleCache;
@@ -367,6 +367,13 @@ class __declspec(uuid("537DCACA-2812-4a4f-B2C6-1A34C17ADEB0"))
     bool m_bOverridePlacement;
     CSize m_overridePlacement;
 
+    // the snapshot is a private copy used for rendering, it is recreated
+    // only when the version changed since it was last taken
+    CCritSec m_csSnapshotLock;
+    ULONG m_nVersion;
+    ULONG m_nSnapshotVersion;
+    CComPtr<ISubPicProvider> m_pSnapshot;
+
     void ParseEffect(CSubtitle* sub, CString str);
     void ParseString(CSubtitle* sub, CStringW str, STSStyle& style);
     void ParsePolygon(CSubtitle* sub, CStringW str, STSStyle& style);
@@ -392,11 +399,13 @@ public:
     void SetOverride(bool bOverride, const STSStyle& styleOverride) {
         m_bOverrideStyle = bOverride;
         m_styleOverride = styleOverride;
+        m_nVersion++;
     }
 
     void SetAlignment(bool bOverridePlacement, LONG lHorPos, LONG lVerPos) {
         m_bOverridePlacement = bOverridePlacement;
         m_overridePlacement.SetSize(lHorPos, lVerPos);
+        m_nVersion++;
     }
 
 public:
@@ -424,4 +433,7 @@ public:
     STDMETHODIMP SetStream(int iStream);
     STDMETHODIMP Reload();
     STDMETHODIMP SetSourceTargetInfo(CString yuvMatrix, int targetBlackLevel, int targetWhiteLevel);
+
+    // ISubPicProviderSnapshot
+    STDMETHODIMP GetSnapshot(ISubPicProvider** ppSnapshot);
 };
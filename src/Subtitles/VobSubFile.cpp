@@ -217,12 +217,25 @@ CString FindLangFromId(WORD id)
 CVobSubFile::CVobSubFile(CCritSec* pLock)
     : CSubPicProviderImpl(pLock)
     , m_sub(1024 * 1024)
+    , m_hSubFile(INVALID_HANDLE_VALUE)
+    , m_hSubMapping(nullptr)
+    , m_subFileSize(0)
+    , m_pSubView(nullptr)
+    , m_subViewStart(0)
+    , m_subViewSize(0)
+    , m_subIndexPos(0)
+    , m_dwLastIndexUpdate(0)
+    , m_bPreDecodeExit(false)
+    , m_nPreDecodeLang(SIZE_T_ERROR)
     , m_nLang(0)
 {
+    ZeroMemory(&m_frameCachePal, sizeof(m_frameCachePal));
 }
 
 CVobSubFile::~CVobSubFile()
 {
+    StopPreDecode();
+    UnmapSub();
 }
 
 //
@@ -235,6 +248,9 @@ bool CVobSubFile::Copy(CVobSubFile& vsf)
     m_title = vsf.m_title;
     m_nLang = vsf.m_nLang;
 
+    // The source might be pre-decoding in the background
+    CAutoLock cAutoLock(&vsf.m_csSub);
+
     m_sub.SetLength(vsf.m_sub.GetLength());
     m_sub.SeekToBegin();
 
@@ -247,37 +263,42 @@ bool CVobSubFile::Copy(CVobSubFile& vsf)
         dst.alt = src.alt;
 
         for (size_t j = 0; j < src.subpos.GetCount(); j++) {
-            SubPos& sp = src.subpos[j];
+            SubPos sp = src.subpos[j];
             if (!sp.bValid) {
                 continue;
             }
 
-            if (sp.filepos != (__int64)vsf.m_sub.Seek(sp.filepos, CFile::begin)) {
+            __int64 pos = sp.filepos;
+            BYTE buff[2048];
+            const BYTE* sector = vsf.GetSubSector(pos, buff);
+            if (!sector) {
                 continue;
             }
+            pos += 2048;
 
             sp.filepos = m_sub.GetPosition();
+            m_sub.Write(sector, 2048);
 
-            BYTE buff[2048];
-            UINT uRead = vsf.m_sub.Read(buff, 2048);
-            m_sub.Write(buff, uRead);
-
-            WORD packetsize = (buff[buff[0x16] + 0x18] << 8) | buff[buff[0x16] + 0x19];
+            WORD packetsize = (sector[sector[0x16] + 0x18] << 8) | sector[sector[0x16] + 0x19];
 
             for (int k = 0, size, sizeleft = packetsize - 4;
                     k < packetsize - 4;
                     k += size, sizeleft -= size) {
-                int hsize = buff[0x16] + 0x18 + ((buff[0x15] & 0x80) ? 4 : 0);
+                int hsize = sector[0x16] + 0x18 + ((sector[0x15] & 0x80) ? 4 : 0);
                 size = std::min(sizeleft, 2048 - hsize);
 
                 if (size != sizeleft) {
-                    while ((uRead = vsf.m_sub.Read(buff, 2048)) > 0) {
-                        if (!(buff[0x15] & 0x80) && buff[buff[0x16] + 0x17] == (i | 0x20)) {
+                    while ((sector = vsf.GetSubSector(pos, buff)) != nullptr) {
+                        pos += 2048;
+                        if (!(sector[0x15] & 0x80) && sector[sector[0x16] + 0x17] == (i | 0x20)) {
                             break;
                         }
                     }
 
-                    m_sub.Write(buff, uRead);
+                    if (!sector) {
+                        break;
+                    }
+                    m_sub.Write(sector, 2048);
                 }
             }
 
@@ -334,7 +355,7 @@ bool CVobSubFile::Open(CString fn)
                 sp[j].bForced = false;
 
                 size_t packetSize = 0, dataSize = 0;
-                BYTE* buff = GetPacket(j, packetSize, dataSize, i);
+                BYTE* buff = GetPacket(j, m_packet, packetSize, dataSize, i);
                 if (!buff) {
                     sp[j].bValid = false;
                     continue;
@@ -353,8 +374,6 @@ bool CVobSubFile::Open(CString fn)
                 if (j > 0 && sp[j - 1].stop > sp[j].start) {
                     sp[j - 1].stop = sp[j].start;
                 }
-
-                delete [] buff;
             }
         }
 
@@ -366,7 +385,7 @@ bool CVobSubFile::Open(CString fn)
     return false;
 }
 
-bool CVobSubFile::Save(CString fn, int delay, SubFormat sf)
+bool CVobSubFile::Save(CString fn, int delay, SubFormat sf, const SaveProgressFunc& progress)
 {
     TrimExtension(fn);
 
@@ -377,13 +396,13 @@ bool CVobSubFile::Save(CString fn, int delay, SubFormat sf)
 
     switch (sf) {
         case VobSub:
-            return vsf.SaveVobSub(fn, delay);
+            return vsf.SaveVobSub(fn, delay, progress);
         case WinSubMux:
-            return vsf.SaveWinSubMux(fn, delay);
+            return vsf.SaveWinSubMux(fn, delay, progress);
         case Scenarist:
-            return vsf.SaveScenarist(fn, delay);
+            return vsf.SaveScenarist(fn, delay, progress);
         case Maestro:
-            return vsf.SaveMaestro(fn, delay);
+            return vsf.SaveMaestro(fn, delay, progress);
         default:
             break;
     }
@@ -393,9 +412,15 @@ bool CVobSubFile::Save(CString fn, int delay, SubFormat sf)
 
 void CVobSubFile::Close()
 {
+    StopPreDecode();
+    for (auto& frames : m_frameCache) {
+        frames.clear();
+    }
+
     InitSettings();
     m_title.Empty();
     m_sub.SetLength(0);
+    UnmapSub();
     m_img.Invalidate();
     m_nLang = SIZE_T_ERROR;
     for (auto& sl : m_langs) {
@@ -744,6 +769,11 @@ bool CVobSubFile::ReadIdx(CString fn, int& ver)
 
 bool CVobSubFile::ReadSub(CString fn)
 {
+    // Only the parts of the file which are actually displayed will be read from the mapping
+    if (MapSub(fn)) {
+        return true;
+    }
+
     CFile f;
     if (!f.Open(fn, CFile::modeRead | CFile::typeBinary | CFile::shareDenyNone)) {
         return false;
@@ -1105,24 +1135,268 @@ bool CVobSubFile::WriteSub(CString fn)
         return false;
     }
 
-    if (m_sub.GetLength() == 0) {
-        return true;    // nothing to do...
+    BYTE buff[2048];
+    for (__int64 pos = 0; const BYTE* sector = GetSubSector(pos, buff); pos += sizeof(buff)) {
+        if (*(DWORD*)sector != 0xba010000) {
+            break;
+        }
+        f.Write(sector, sizeof(buff));
     }
 
-    m_sub.SeekToBegin();
+    return true;
+}
 
-    int len;
-    BYTE buff[2048];
-    while ((len = m_sub.Read(buff, sizeof(buff))) > 0 && *(DWORD*)buff == 0xba010000) {
-        f.Write(buff, len);
+bool CVobSubFile::MapSub(CString fn)
+{
+    UnmapSub();
+
+    HANDLE hFile = CreateFile(fn, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    HANDLE hMapping = nullptr;
+    // Empty files can't be mapped
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart > 0) {
+        hMapping = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (!hMapping) {
+        CloseHandle(hFile);
+        return false;
+    }
+
+    m_sub.SetLength(0);
+    m_hSubFile = hFile;
+    m_hSubMapping = hMapping;
+    m_subFileSize = size.QuadPart;
+    // Everything present when opening is described by the .idx file
+    m_subIndexPos = m_subFileSize & ~0x7ffi64;
+    m_dwLastIndexUpdate = GetTickCount();
+
+    return true;
+}
+
+void CVobSubFile::UnmapSub()
+{
+    if (m_pSubView) {
+        UnmapViewOfFile(m_pSubView);
+        m_pSubView = nullptr;
+    }
+    if (m_hSubMapping) {
+        CloseHandle(m_hSubMapping);
+        m_hSubMapping = nullptr;
+    }
+    if (m_hSubFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_hSubFile);
+        m_hSubFile = INVALID_HANDLE_VALUE;
+    }
+    m_subFileSize = m_subViewStart = m_subViewSize = 0;
+    m_subIndexPos = 0;
+}
+
+bool CVobSubFile::RemapSub(__int64 size)
+{
+    // A mapping can't grow so a new one has to be created for the current size of the file
+    HANDLE hMapping = CreateFileMapping(m_hSubFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!hMapping) {
+        return false;
+    }
+
+    if (m_pSubView) {
+        UnmapViewOfFile(m_pSubView);
+        m_pSubView = nullptr;
+    }
+    CloseHandle(m_hSubMapping);
+
+    m_hSubMapping = hMapping;
+    m_subFileSize = size;
+    m_subViewStart = m_subViewSize = 0;
+
+    return true;
+}
+
+bool CVobSubFile::GetSubPTS(__int64 pos, __int64& pts)
+{
+    BYTE buff[0x800];
+    const BYTE* sector = GetSubSector(pos, buff);
+    if (!sector
+            || *(DWORD*)&sector[0x00] != 0xba010000
+            || *(DWORD*)&sector[0x0e] != 0xbd010000
+            || !(sector[0x15] & 0x80)) {
+        return false;
     }
 
+    const BYTE* p = &sector[0x17];
+    pts = (__int64(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+    pts /= 90; // ms
+
     return true;
 }
 
+void CVobSubFile::UpdateIndex()
+{
+    // Only the files read from the disk can grow
+    if (!m_hSubMapping) {
+        return;
+    }
+
+    DWORD dwNow = GetTickCount();
+    if (dwNow - m_dwLastIndexUpdate < 1000) {
+        return;
+    }
+    m_dwLastIndexUpdate = dwNow;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_hSubFile, &size) || size.QuadPart <= m_subFileSize) {
+        return;
+    }
+
+    // m_langs is about to be modified
+    StopPreDecode();
+
+    CAutoLock cAutoLock(&m_csSub);
+
+    if (!RemapSub(size.QuadPart)) {
+        return;
+    }
+
+    // The timestamps of the .idx file don't necessarily match the PTS of the packets, the
+    // offset between them is taken from the last indexed packet and applied to the new ones
+    auto getOffset = [this](const CAtlArray<SubPos>& sp, __int64& offset) {
+        __int64 pts;
+        if (sp.IsEmpty() || !GetSubPTS(sp[sp.GetCount() - 1].filepos, pts)) {
+            return false;
+        }
+        offset = sp[sp.GetCount() - 1].start - pts;
+        return true;
+    };
+
+    __int64 defaultOffset = 0;
+    for (const auto& sl : m_langs) {
+        if (getOffset(sl.subpos, defaultOffset)) {
+            break;
+        }
+    }
+
+    CVobSubImage img;
+    BYTE buff[0x800];
+
+    for (__int64 pos = m_subIndexPos; pos + 0x800 <= m_subFileSize; pos += 0x800, m_subIndexPos = pos) {
+        const BYTE* sector = GetSubSector(pos, buff);
+        if (!sector) {
+            break;
+        }
+
+        // Only the first sector of a packet has a PTS
+        __int64 pts;
+        if ((sector[sector[0x16] + 0x17] & 0xe0) != 0x20 || !GetSubPTS(pos, pts)) {
+            continue;
+        }
+
+        size_t nLang = sector[sector[0x16] + 0x17] & 0x1f;
+        SubLang& sl = m_langs[nLang];
+        CAtlArray<SubPos>& sp = sl.subpos;
+
+        __int64 offset;
+        if (!getOffset(sp, offset)) {
+            offset = defaultOffset;
+        }
+
+        SubPos newsp;
+        if (!sp.IsEmpty()) {
+            const SubPos& last = sp[sp.GetCount() - 1];
+            // The packet was already indexed or it can't be inserted without breaking the ordering
+            if (pos <= last.filepos || pts + offset < last.start) {
+                continue;
+            }
+            newsp.vobid = last.vobid;
+            newsp.cellid = last.cellid;
+            newsp.celltimestamp = last.celltimestamp;
+        } else if (sl.alt.IsEmpty()) {
+            if (sl.id) {
+                sl.name = sl.alt = FindLangFromId(sl.id);
+            } else {
+                // The stream isn't listed in the index so its language is unknown
+                sl.name.Format(_T("Unknown (stream %Iu)"), nLang);
+                sl.alt = sl.name;
+            }
+        }
+        newsp.filepos = pos;
+        newsp.start = newsp.stop = pts + offset;
+        newsp.bValid = true;
+
+        size_t j = sp.Add(newsp);
+
+        size_t packetSize = 0, dataSize = 0;
+        BYTE* packet = GetPacket(j, m_packet, packetSize, dataSize, nLang);
+        if (!packet) {
+            sp.RemoveAt(j);
+            // The packet is most likely still being written, try again later unless
+            // the file has grown too much since for this to be the case
+            if (m_subFileSize - pos < 1024 * 1024) {
+                break;
+            }
+            continue;
+        }
+
+        img.delay = 3000;
+        img.GetPacketInfo(packet, packetSize, dataSize);
+
+        sp[j].stop = sp[j].start + img.delay;
+        sp[j].bForced = img.bForced;
+        sp[j].bAnimated = img.bAnimated;
+
+        if (j > 0 && sp[j - 1].stop > sp[j].start) {
+            sp[j - 1].stop = sp[j].start;
+        }
+    }
+}
+
+const BYTE* CVobSubFile::GetSubSector(__int64 pos, BYTE* buff)
+{
+    const __int64 sectorSize = 0x800;
+
+    if (!m_hSubMapping) {
+        if ((__int64)m_sub.Seek(pos, CFile::begin) != pos || m_sub.Read(buff, (UINT)sectorSize) != sectorSize) {
+            return nullptr;
+        }
+        return buff;
+    }
+
+    if (pos < 0 || pos + sectorSize > m_subFileSize) {
+        return nullptr;
+    }
+
+    if (!m_pSubView || pos < m_subViewStart || pos + sectorSize > m_subViewStart + m_subViewSize) {
+        const __int64 viewSize = 32 * 1024 * 1024;
+
+        if (m_pSubView) {
+            UnmapViewOfFile(m_pSubView);
+            m_pSubView = nullptr;
+        }
+
+        // Views must start on the allocation granularity
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        __int64 start = pos - pos % si.dwAllocationGranularity;
+        __int64 size = std::min(viewSize, m_subFileSize - start);
+
+        m_pSubView = (const BYTE*)MapViewOfFile(m_hSubMapping, FILE_MAP_READ, DWORD(start >> 32), DWORD(start), SIZE_T(size));
+        if (!m_pSubView) {
+            return nullptr;
+        }
+        m_subViewStart = start;
+        m_subViewSize = size;
+    }
+
+    return m_pSubView + (pos - m_subViewStart);
+}
+
 //
 
-BYTE* CVobSubFile::GetPacket(size_t idx, size_t& packetSize, size_t& dataSize, size_t nLang /*= SIZE_T_ERROR*/)
+BYTE* CVobSubFile::GetPacket(size_t idx, std::vector<BYTE>& buff, size_t& packetSize, size_t& dataSize, size_t nLang /*= SIZE_T_ERROR*/)
 {
     BYTE* ret = nullptr;
 
@@ -1131,60 +1405,68 @@ BYTE* CVobSubFile::GetPacket(size_t idx, size_t& packetSize, size_t& dataSize, s
     }
     CAtlArray<SubPos>& sp = m_langs[nLang].subpos;
 
+    CAutoLock cAutoLock(&m_csSub);
+
     do {
         if (idx >= sp.GetCount()) {
             break;
         }
 
-        if ((__int64)m_sub.Seek(sp[idx].filepos, CFile::begin) != sp[idx].filepos) {
-            break;
-        }
-
-        BYTE buff[0x800];
-        if (sizeof(buff) != m_sub.Read(buff, sizeof(buff))) {
+        __int64 pos = sp[idx].filepos;
+        BYTE sectorBuff[0x800];
+        const BYTE* sector = GetSubSector(pos, sectorBuff);
+        if (!sector) {
             break;
         }
+        pos += sizeof(sectorBuff);
 
         ASSERT(nLang < BYTE_MAX);
 
         // let's check a few things to make sure...
-        if (*(DWORD*)&buff[0x00] != 0xba010000
-                || *(DWORD*)&buff[0x0e] != 0xbd010000
-                || !(buff[0x15] & 0x80)
-                || (buff[0x17] & 0xf0) != 0x20
-                || (buff[buff[0x16] + 0x17] & 0xe0) != 0x20
-                || (buff[buff[0x16] + 0x17] & 0x1f) != (BYTE)nLang) {
+        if (*(DWORD*)&sector[0x00] != 0xba010000
+                || *(DWORD*)&sector[0x0e] != 0xbd010000
+                || !(sector[0x15] & 0x80)
+                || (sector[0x17] & 0xf0) != 0x20
+                || (sector[sector[0x16] + 0x17] & 0xe0) != 0x20
+                || (sector[sector[0x16] + 0x17] & 0x1f) != (BYTE)nLang) {
             break;
         }
 
-        packetSize = (buff[buff[0x16] + 0x18] << 8) + buff[buff[0x16] + 0x19];
-        dataSize = (buff[buff[0x16] + 0x1a] << 8) + buff[buff[0x16] + 0x1b];
+        packetSize = (sector[sector[0x16] + 0x18] << 8) + sector[sector[0x16] + 0x19];
+        dataSize = (sector[sector[0x16] + 0x1a] << 8) + sector[sector[0x16] + 0x1b];
 
         try {
-            ret = DEBUG_NEW BYTE[packetSize];
+            if (buff.size() < packetSize) {
+                buff.resize(packetSize);
+            }
         } catch (CMemoryException* e) {
             ASSERT(FALSE);
             e->Delete();
             break;
         }
+        ret = buff.data();
 
         size_t i = 0, sizeLeft = packetSize;
         for (size_t size; i < packetSize; i += size, sizeLeft -= size) {
-            size_t hsize = 0x18 + buff[0x16];
+            size_t hsize = 0x18 + sector[0x16];
             size = std::min(sizeLeft, 0x800 - hsize);
-            memcpy(&ret[i], &buff[hsize], size);
+            memcpy(&ret[i], &sector[hsize], size);
 
             if (size != sizeLeft) {
-                while (m_sub.Read(buff, sizeof(buff))) {
-                    if (/*!(buff[0x15] & 0x80) &&*/ buff[buff[0x16] + 0x17] == (nLang | 0x20)) {
+                while ((sector = GetSubSector(pos, sectorBuff)) != nullptr) {
+                    pos += sizeof(sectorBuff);
+                    if (/*!(sector[0x15] & 0x80) &&*/ sector[sector[0x16] + 0x17] == (nLang | 0x20)) {
                         break;
                     }
                 }
+
+                if (!sector) {
+                    break;
+                }
             }
         }
 
         if (i != packetSize || sizeLeft > 0) {
-            delete [] ret;
             ret = nullptr;
         }
     } while (false);
@@ -1221,31 +1503,207 @@ bool CVobSubFile::GetFrame(size_t idx, size_t nLang /*= SIZE_T_ERROR*/, REFERENC
 
     if (m_img.nLang != nLang || m_img.nIdx != idx
             || (sp[idx].bAnimated && sp[idx].start + m_img.tCurrent <= rt)) {
-        size_t packetSize = 0, dataSize = 0;
-        CAutoVectorPtr<BYTE> buff;
-        buff.Attach(GetPacket(idx, packetSize, dataSize, nLang));
-        if (!buff || packetSize == 0 || dataSize == 0) {
-            return false;
-        }
+        if (sp[idx].bAnimated || !LookupFrame(idx, nLang)) {
+            size_t packetSize = 0, dataSize = 0;
+            BYTE* buff = GetPacket(idx, m_packet, packetSize, dataSize, nLang);
+            if (!buff || packetSize == 0 || dataSize == 0) {
+                return false;
+            }
 
-        m_img.start = sp[idx].start;
+            m_img.start = sp[idx].start;
 
-        bool ret = m_img.Decode(buff, packetSize, dataSize, rt >= 0 ? int(rt - sp[idx].start) : INT_MAX,
-                                m_bCustomPal, m_tridx, m_orgpal, m_cuspal, true);
+            bool ret = m_img.Decode(buff, packetSize, dataSize, rt >= 0 ? int(rt - sp[idx].start) : INT_MAX,
+                                    m_bCustomPal, m_tridx, m_orgpal, m_cuspal, true);
 
-        m_img.delay = sp[idx].stop - sp[idx].start;
+            m_img.delay = sp[idx].stop - sp[idx].start;
 
-        if (!ret) {
-            return false;
+            if (!ret) {
+                return false;
+            }
+
+            if (!sp[idx].bAnimated && !m_img.rect.IsRectEmpty()) {
+                std::lock_guard<std::mutex> lock(m_mutexFrameCache);
+                CacheFrame(idx, nLang, m_img);
+            }
         }
 
         m_img.nIdx = idx;
         m_img.nLang = nLang;
+
+        PreDecode(idx + 1, nLang);
     }
 
     return (m_bOnlyShowForcedSubs ? m_img.bForced : true);
 }
 
+void CVobSubFile::UpdateFrameCachePalette()
+{
+    DecodePalette pal;
+    ZeroMemory(&pal, sizeof(pal));
+    pal.bCustomPal = m_bCustomPal;
+    pal.tridx = m_tridx;
+    memcpy(pal.orgpal, m_orgpal, sizeof(pal.orgpal));
+    memcpy(pal.cuspal, m_cuspal, sizeof(pal.cuspal));
+
+    // The palette is applied while decoding so the cached frames are useless once it has changed
+    if (memcmp(&pal, &m_frameCachePal, sizeof(pal))) {
+        for (auto& frames : m_frameCache) {
+            frames.clear();
+        }
+        m_frameCachePal = pal;
+    }
+}
+
+const CVobSubFile::DecodedFrame* CVobSubFile::FindFrame(size_t idx, size_t nLang)
+{
+    auto& frames = m_frameCache[nLang];
+
+    for (auto it = frames.begin(); it != frames.end(); ++it) {
+        if (it->nIdx == idx) {
+            // Move it to the front so that the least recently used frame is always at the back
+            frames.splice(frames.begin(), frames, it);
+            return &frames.front();
+        }
+    }
+
+    return nullptr;
+}
+
+void CVobSubFile::CacheFrame(size_t idx, size_t nLang, const CVobSubImage& img)
+{
+    auto& frames = m_frameCache[nLang];
+
+    if (FindFrame(idx, nLang)) {
+        return;
+    }
+
+    if (frames.size() >= FRAME_CACHE_SIZE) {
+        // Recycle the least recently used frame instead of allocating a new one
+        frames.splice(frames.begin(), frames, std::prev(frames.end()));
+        frames.front().Assign(idx, img);
+    } else {
+        frames.emplace_front(idx, img);
+    }
+}
+
+bool CVobSubFile::LookupFrame(size_t idx, size_t nLang)
+{
+    std::lock_guard<std::mutex> lock(m_mutexFrameCache);
+
+    UpdateFrameCachePalette();
+
+    const DecodedFrame* pFrame = FindFrame(idx, nLang);
+    if (!pFrame || !m_img.Alloc(pFrame->rect.Width(), pFrame->rect.Height())) {
+        return false;
+    }
+
+    const SubPos& sp = m_langs[nLang].subpos[idx];
+
+    memcpy(m_img.lpPixels, pFrame->pixels.data(), pFrame->pixels.size() * sizeof(RGBQUAD));
+    m_img.rect = pFrame->rect;
+    memcpy(m_img.pal, pFrame->pal, sizeof(m_img.pal));
+    m_img.bForced = pFrame->bForced;
+    m_img.bAnimated = false;
+    m_img.tCurrent = pFrame->tCurrent;
+    m_img.start = sp.start;
+    m_img.delay = sp.stop - sp.start;
+    m_img.bCustomPal = m_bCustomPal;
+    m_img.tridx = m_tridx;
+    m_img.orgpal = m_orgpal;
+    m_img.cuspal = m_cuspal;
+
+    return true;
+}
+
+void CVobSubFile::PreDecode(size_t idx, size_t nLang)
+{
+    {
+        const CAtlArray<SubPos>& sp = m_langs[nLang].subpos;
+
+        std::lock_guard<std::mutex> lock(m_mutexFrameCache);
+
+        UpdateFrameCachePalette();
+        m_nPreDecodeLang = nLang;
+        m_preDecodeIdxs.clear();
+        for (size_t end = std::min(idx + PREDECODE_AHEAD, sp.GetCount()); idx < end; idx++) {
+            if (sp[idx].bValid && !sp[idx].bAnimated) {
+                m_preDecodeIdxs.push_back(idx);
+            }
+        }
+        if (m_preDecodeIdxs.empty()) {
+            return;
+        }
+    }
+
+    if (!m_preDecodeThread.joinable()) {
+        m_bPreDecodeExit = false;
+        m_preDecodeThread = std::thread([this] { PreDecodeThread(); });
+    } else {
+        m_preDecodeCV.notify_one();
+    }
+}
+
+void CVobSubFile::StopPreDecode()
+{
+    if (m_preDecodeThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutexFrameCache);
+            m_bPreDecodeExit = true;
+            m_preDecodeIdxs.clear();
+        }
+        m_preDecodeCV.notify_one();
+        m_preDecodeThread.join();
+    }
+}
+
+void CVobSubFile::PreDecodeThread()
+{
+    SetThreadName(DWORD(-1), "VobSub Pre-decoder Thread");
+
+    CVobSubImage img;
+    std::vector<BYTE> packet;
+    std::vector<size_t> idxs;
+
+    std::unique_lock<std::mutex> lock(m_mutexFrameCache);
+
+    for (;;) {
+        m_preDecodeCV.wait(lock, [this] { return m_bPreDecodeExit || !m_preDecodeIdxs.empty(); });
+        if (m_bPreDecodeExit) {
+            break;
+        }
+
+        size_t nLang = m_nPreDecodeLang;
+        idxs.swap(m_preDecodeIdxs);
+        m_preDecodeIdxs.clear();
+        DecodePalette pal = m_frameCachePal;
+
+        // Only the subpos fields which Subresync never edits are read from here
+        // on, by GetPacket. Give up on the current job as soon as a new one is posted.
+        for (auto it = idxs.cbegin(); it != idxs.cend() && !m_bPreDecodeExit && m_preDecodeIdxs.empty(); ++it) {
+            size_t idx = *it;
+            if (FindFrame(idx, nLang)) {
+                continue;
+            }
+
+            lock.unlock();
+
+            size_t packetSize = 0, dataSize = 0;
+            BYTE* buff = GetPacket(idx, packet, packetSize, dataSize, nLang);
+            bool ret = buff && packetSize && dataSize
+                       && img.Decode(buff, packetSize, dataSize, INT_MAX,
+                                     pal.bCustomPal, pal.tridx, pal.orgpal, pal.cuspal, true)
+                       && !img.rect.IsRectEmpty();
+
+            lock.lock();
+
+            // The frame is dropped if the palette was changed while it was being decoded
+            if (ret && !memcmp(&pal, &m_frameCachePal, sizeof(pal))) {
+                CacheFrame(idx, nLang, img);
+            }
+        }
+    }
+}
+
 bool CVobSubFile::GetFrameByTimeStamp(__int64 time)
 {
     return GetFrame(GetFrameIdxByTimeStamp(time));
@@ -1308,6 +1766,8 @@ STDMETHODIMP CVobSubFile::NonDelegatingQueryInterface(REFIID riid, void** ppv)
 
 STDMETHODIMP_(POSITION) CVobSubFile::GetStartPosition(REFERENCE_TIME rt, double fps)
 {
+    UpdateIndex();
+
     rt /= 10000;
 
     size_t i = GetFrameIdxByTimeStamp(rt);
@@ -1723,58 +2183,202 @@ static bool CompressFile(CString fn)
     return !!b;
 }
 
-bool CVobSubFile::SaveVobSub(CString fn, int delay)
+bool CVobSubFile::DecodeFrame(size_t idx, CVobSubImage& img, std::vector<BYTE>& packet)
 {
-    return WriteIdx(fn + _T(".idx"), delay) && WriteSub(fn + _T(".sub"));
+    const SubPos& sp = m_langs[m_nLang].subpos[idx];
+
+    size_t packetSize = 0, dataSize = 0;
+    BYTE* buff = GetPacket(idx, packet, packetSize, dataSize, m_nLang);
+    if (!buff || packetSize == 0 || dataSize == 0) {
+        return false;
+    }
+
+    img.start = sp.start;
+
+    bool ret = img.Decode(buff, packetSize, dataSize, INT_MAX, m_bCustomPal, m_tridx, m_orgpal, m_cuspal, true);
+
+    img.delay = sp.stop - sp.start;
+
+    return ret && (m_bOnlyShowForcedSubs ? img.bForced : true);
 }
 
-bool CVobSubFile::SaveWinSubMux(CString fn, int delay)
+bool CVobSubFile::ExportFrames(const ExportConvertFunc& convert, const ExportWriteFunc& write, const SaveProgressFunc& progress)
 {
-    TrimExtension(fn);
+    const size_t nCount = m_langs[m_nLang].subpos.GetCount();
+    const size_t nThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    // The frames converted ahead of the writer are kept in a ring of slots
+    // so that the memory usage doesn't depend on the number of frames
+    const size_t nSlots = 2 * nThreads;
 
-    CStdioFile f;
-    if (!f.Open(fn + _T(".sub"), CFile::modeCreate | CFile::modeWrite | CFile::typeText | CFile::shareDenyWrite)) {
-        return false;
-    }
+    struct Slot {
+        size_t idx = SIZE_T_ERROR;  // SIZE_T_ERROR when the slot is free
+        bool bReady = false;
+        bool bValid = false;
+        CVobSubImage img;
+        std::vector<BYTE> data;
+    };
+    std::unique_ptr<Slot[]> slots(DEBUG_NEW Slot[nSlots]);
 
-    m_img.Invalidate();
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t nNext = 0;
+    bool bStop = false;
 
-    CAutoVectorPtr<BYTE> p4bpp;
-    if (!p4bpp.Allocate(720 * 576 / 2)) {
-        return false;
+    auto worker = [&]() {
+        std::vector<BYTE> packet;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for (;;) {
+            cv.wait(lock, [&] { return bStop || nNext >= nCount || slots[nNext % nSlots].idx == SIZE_T_ERROR; });
+            if (bStop || nNext >= nCount) {
+                break;
+            }
+
+            size_t i = nNext++;
+            Slot& slot = slots[i % nSlots];
+            slot.idx = i;
+
+            lock.unlock();
+            bool bValid = DecodeFrame(i, slot.img, packet) && convert(i, slot.img, slot.data);
+            lock.lock();
+
+            slot.bValid = bValid;
+            slot.bReady = true;
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nThreads; i++) {
+        workers.emplace_back(worker);
     }
 
-    CAtlArray<SubPos>& sp = m_langs[m_nLang].subpos;
-    for (size_t i = 0; i < sp.GetCount(); i++) {
-        if (!GetFrame(i)) {
-            continue;
+    auto stopWorkers = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bStop = true;
+        }
+        cv.notify_all();
+        for (auto& thread : workers) {
+            thread.join();
         }
+    };
 
-        int pal[4] = {0, 1, 2, 3};
+    bool bCancelled = false;
 
-        for (int j = 0; j < 5; j++) {
-            if (j == 4 || !m_img.pal[j].tr) {
-                j &= 3;
-                memset(p4bpp, (j << 4) | j, 720 * 576 / 2);
-                pal[j] ^= pal[0], pal[0] ^= pal[j], pal[j] ^= pal[0];
-                break;
+    try {
+        for (size_t i = 0; i < nCount && !bCancelled; i++) {
+            Slot& slot = slots[i % nSlots];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return slot.idx == i && slot.bReady; });
+            }
+
+            if (slot.bValid) {
+                write(i, slot.img, slot.data);
             }
+            bCancelled = progress && !progress(i + 1, nCount);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.idx = SIZE_T_ERROR;
+                slot.bReady = false;
+            }
+            cv.notify_all();
+        }
+    } catch (...) {
+        // The workers reference this stack frame so they must be stopped before unwinding it
+        stopWorkers();
+        throw;
+    }
+
+    stopWorkers();
+
+    return !bCancelled;
+}
+
+bool CVobSubFile::SaveVobSub(CString fn, int delay, const SaveProgressFunc& progress)
+{
+    // Nothing is decoded here, the packets are only copied
+    bool ret = WriteIdx(fn + _T(".idx"), delay) && WriteSub(fn + _T(".sub"));
+    if (ret && progress) {
+        progress(1, 1);
+    }
+    return ret;
+}
+
+// WinSubMux expects the background color, i.e. the first transparent one, to come first in the palette
+static int GetWinSubMuxPalette(const CVobSubImage& img, int pal[4])
+{
+    for (int j = 0; j < 4; j++) {
+        pal[j] = j;
+    }
+
+    for (int j = 0; j < 5; j++) {
+        if (j == 4 || !img.pal[j].tr) {
+            j &= 3;
+            std::swap(pal[0], pal[j]);
+            return j;
+        }
+    }
+
+    return 0;
+}
+
+// Converts a frame to the 720 pixels wide 4bpp bitmaps of Scenarist and Maestro,
+// the frame must have been decoded using their custom palette
+static void ConvertTo4bpp(const CVobSubImage& img, int height, BYTE* p4bpp)
+{
+    for (int j = 0; j < 5; j++) {
+        if (j == 4 || !img.pal[j].tr) {
+            j &= 3;
+            memset(p4bpp, (j << 4) | j, (height - 2) * 360);
+            break;
+        }
+    }
+
+    for (ptrdiff_t y = std::max(img.rect.top + 1, 2l); y < img.rect.bottom - 1; y++) {
+        ASSERT(height - y - 1 >= 0);
+        if (height - y - 1 < 0) {
+            break;
+        }
+
+        const DWORD* p = (const DWORD*)&img.lpPixels[(y - img.rect.top) * img.rect.Width() + 1];
+
+        for (ptrdiff_t x = img.rect.left + 1; x < img.rect.right - 1; x++, p++) {
+            DWORD rgb = *p & 0xffffff;
+            BYTE c = rgb == 0x0000ff ? 0 : rgb == 0xff0000 ? 1 : rgb == 0x000000 ? 2 : 3;
+            BYTE& c4bpp = p4bpp[(height - y - 1) * 360 + (x >> 1)];
+            c4bpp = (x & 1) ? ((c4bpp & 0xf0) | c) : ((c4bpp & 0x0f) | (c << 4));
         }
+    }
+}
 
-        int tr[4] = {m_img.pal[pal[0]].tr, m_img.pal[pal[1]].tr, m_img.pal[pal[2]].tr, m_img.pal[pal[3]].tr};
+bool CVobSubFile::SaveWinSubMux(CString fn, int delay, const SaveProgressFunc& progress)
+{
+    TrimExtension(fn);
+
+    CStdioFile f;
+    if (!f.Open(fn + _T(".sub"), CFile::modeCreate | CFile::modeWrite | CFile::typeText | CFile::shareDenyWrite)) {
+        return false;
+    }
+
+    auto convert = [this](size_t, const CVobSubImage& img, std::vector<BYTE>& data) {
+        int pal[4];
+        int bg = GetWinSubMuxPalette(img, pal);
 
-        DWORD uipal[4 + 12];
+        DWORD uipal[4 + 12] = {0};
 
         if (!m_bCustomPal) {
-            uipal[0] = *((DWORD*)&m_img.orgpal[m_img.pal[pal[0]].pal]);
-            uipal[1] = *((DWORD*)&m_img.orgpal[m_img.pal[pal[1]].pal]);
-            uipal[2] = *((DWORD*)&m_img.orgpal[m_img.pal[pal[2]].pal]);
-            uipal[3] = *((DWORD*)&m_img.orgpal[m_img.pal[pal[3]].pal]);
+            uipal[0] = *((DWORD*)&img.orgpal[img.pal[pal[0]].pal]);
+            uipal[1] = *((DWORD*)&img.orgpal[img.pal[pal[1]].pal]);
+            uipal[2] = *((DWORD*)&img.orgpal[img.pal[pal[2]].pal]);
+            uipal[3] = *((DWORD*)&img.orgpal[img.pal[pal[3]].pal]);
         } else {
-            uipal[0] = *((DWORD*)&m_img.cuspal[pal[0]]) & 0xffffff;
-            uipal[1] = *((DWORD*)&m_img.cuspal[pal[1]]) & 0xffffff;
-            uipal[2] = *((DWORD*)&m_img.cuspal[pal[2]]) & 0xffffff;
-            uipal[3] = *((DWORD*)&m_img.cuspal[pal[3]]) & 0xffffff;
+            uipal[0] = *((DWORD*)&img.cuspal[pal[0]]) & 0xffffff;
+            uipal[1] = *((DWORD*)&img.cuspal[pal[1]]) & 0xffffff;
+            uipal[2] = *((DWORD*)&img.cuspal[pal[2]]) & 0xffffff;
+            uipal[3] = *((DWORD*)&img.cuspal[pal[3]]) & 0xffffff;
         }
 
         CAtlMap<DWORD, BYTE> palmap;
@@ -1785,12 +2389,39 @@ bool CVobSubFile::SaveWinSubMux(CString fn, int delay)
 
         uipal[0] = 0xff; // blue background
 
-        int w = m_img.rect.Width() - 2;
-        int h = m_img.rect.Height() - 2;
+        int w = img.rect.Width() - 2;
+        int h = img.rect.Height() - 2;
+        if (w <= 0 || h <= 0) {
+            return false;
+        }
         int pitch = (((w + 1) >> 1) + 3) & ~3;
 
+        BITMAPFILEHEADER fhdr = {
+            0x4d42,
+            sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 16 * sizeof(RGBQUAD) + pitch * h,
+            0, 0,
+            sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 16 * sizeof(RGBQUAD)
+        };
+
+        BITMAPINFOHEADER ihdr = {
+            sizeof(BITMAPINFOHEADER),
+            w, h, 1, 4, 0,
+            0,
+            pitch * h, 0,
+            16, 4
+        };
+
+        // The whole bitmap file is prepared here so that the writer only has to dump it
+        data.resize(fhdr.bfOffBits + pitch * h);
+        memcpy(&data[0], &fhdr, sizeof(fhdr));
+        memcpy(&data[sizeof(fhdr)], &ihdr, sizeof(ihdr));
+        memcpy(&data[sizeof(fhdr) + sizeof(ihdr)], uipal, sizeof(RGBQUAD) * 16);
+
+        BYTE* p4bpp = &data[fhdr.bfOffBits];
+        memset(p4bpp, (bg << 4) | bg, pitch * h);
+
         for (ptrdiff_t y = 0; y < h; y++) {
-            DWORD* p = (DWORD*)&m_img.lpPixels[(y + 1) * (w + 2) + 1];
+            const DWORD* p = (const DWORD*)&img.lpPixels[(y + 1) * (w + 2) + 1];
 
             for (ptrdiff_t x = 0; x < w; x++, p++) {
                 BYTE c = 0;
@@ -1805,13 +2436,22 @@ bool CVobSubFile::SaveWinSubMux(CString fn, int delay)
             }
         }
 
-        int t1 = (int)m_img.start + delay;
-        int t2 = t1 + (int)m_img.delay /*+ (m_size.cy==480?(1000/29.97+1):(1000/25))*/;
+        return true;
+    };
+
+    auto write = [&](size_t i, const CVobSubImage& img, const std::vector<BYTE>& data) {
+        int pal[4];
+        GetWinSubMuxPalette(img, pal);
+
+        int tr[4] = {img.pal[pal[0]].tr, img.pal[pal[1]].tr, img.pal[pal[2]].tr, img.pal[pal[3]].tr};
+
+        int t1 = (int)img.start + delay;
+        int t2 = t1 + (int)img.delay /*+ (m_size.cy==480?(1000/29.97+1):(1000/25))*/;
 
         ASSERT(t2 > t1);
 
         if (t2 <= 0) {
-            continue;
+            return;
         }
         if (t1 < 0) {
             t1 = 0;
@@ -1825,41 +2465,23 @@ bool CVobSubFile::SaveWinSubMux(CString fn, int delay)
                    bmpfn,
                    t1 / 1000 / 60 / 60, (t1 / 1000 / 60) % 60, (t1 / 1000) % 60, (t1 % 1000) / 10,
                    t2 / 1000 / 60 / 60, (t2 / 1000 / 60) % 60, (t2 / 1000) % 60, (t2 % 1000) / 10,
-                   m_img.rect.Width(), m_img.rect.Height(), m_img.rect.left, m_img.rect.top,
+                   img.rect.Width(), img.rect.Height(), img.rect.left, img.rect.top,
                    (tr[0] << 4) | tr[0], (tr[1] << 4) | tr[1], (tr[2] << 4) | tr[2], (tr[3] << 4) | tr[3]);
         f.WriteString(str);
 
-        BITMAPFILEHEADER fhdr = {
-            0x4d42,
-            sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 16 * sizeof(RGBQUAD) + pitch * h,
-            0, 0,
-            sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 16 * sizeof(RGBQUAD)
-        };
-
-        BITMAPINFOHEADER ihdr = {
-            sizeof(BITMAPINFOHEADER),
-            w, h, 1, 4, 0,
-            0,
-            pitch * h, 0,
-            16, 4
-        };
-
         CFile bmp;
         if (bmp.Open(bmpfn, CFile::modeCreate | CFile::modeWrite | CFile::typeBinary | CFile::shareDenyWrite)) {
-            bmp.Write(&fhdr, sizeof(fhdr));
-            bmp.Write(&ihdr, sizeof(ihdr));
-            bmp.Write(uipal, sizeof(RGBQUAD) * 16);
-            bmp.Write(p4bpp, pitch * h);
+            bmp.Write(data.data(), (UINT)data.size());
             bmp.Close();
 
             CompressFile(bmpfn);
         }
-    }
+    };
 
-    return true;
+    return ExportFrames(convert, write, progress);
 }
 
-bool CVobSubFile::SaveScenarist(CString fn, int delay)
+bool CVobSubFile::SaveScenarist(CString fn, int delay, const SaveProgressFunc& progress)
 {
     TrimExtension(fn);
 
@@ -1868,8 +2490,6 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
         return false;
     }
 
-    m_img.Invalidate();
-
     fn.Replace('\\', '/');
     CString title = fn.Mid(fn.ReverseFind('/') + 1);
 
@@ -1953,11 +2573,6 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
     memcpy(tempCusPal, m_cuspal, sizeof(tempCusPal));
     memcpy(m_cuspal, newCusPal, sizeof(m_cuspal));
 
-    CAutoVectorPtr<BYTE> p4bpp;
-    if (!p4bpp.Allocate((m_size.cy - 2) * 360)) {
-        return false;
-    }
-
     BYTE colormap[16];
 
     for (size_t i = 0; i < 16; i++) {
@@ -1981,42 +2596,22 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
 
     int pc[4] = {1, 1, 1, 1}, pa[4] = {15, 15, 15, 0};
 
-    CAtlArray<SubPos>& sp = m_langs[m_nLang].subpos;
-    for (size_t i = 0, k = 0; i < sp.GetCount(); i++) {
-        if (!GetFrame(i)) {
-            continue;
-        }
-
-        for (int j = 0; j < 5; j++) {
-            if (j == 4 || !m_img.pal[j].tr) {
-                j &= 3;
-                memset(p4bpp, (j << 4) | j, (m_size.cy - 2) * 360);
-                break;
-            }
-        }
-
-        for (ptrdiff_t y = std::max(m_img.rect.top + 1, 2l); y < m_img.rect.bottom - 1; y++) {
-            ASSERT(m_size.cy - y - 1 >= 0);
-            if (m_size.cy - y - 1 < 0) {
-                break;
-            }
-
-            DWORD* p = (DWORD*)&m_img.lpPixels[(y - m_img.rect.top) * m_img.rect.Width() + 1];
+    auto convert = [this](size_t, const CVobSubImage& img, std::vector<BYTE>& data) {
+        data.resize((m_size.cy - 2) * 360);
+        ConvertTo4bpp(img, m_size.cy, data.data());
+        return true;
+    };
 
-            for (ptrdiff_t x = m_img.rect.left + 1; x < m_img.rect.right - 1; x++, p++) {
-                DWORD rgb = *p & 0xffffff;
-                BYTE c = rgb == 0x0000ff ? 0 : rgb == 0xff0000 ? 1 : rgb == 0x000000 ? 2 : 3;
-                BYTE& c4bpp = p4bpp[(m_size.cy - y - 1) * 360 + (x >> 1)];
-                c4bpp = (x & 1) ? ((c4bpp & 0xf0) | c) : ((c4bpp & 0x0f) | (c << 4));
-            }
-        }
+    const CAtlArray<SubPos>& sp = m_langs[m_nLang].subpos;
+    size_t k = 0;
 
+    auto write = [&](size_t i, const CVobSubImage& img, const std::vector<BYTE>& data) {
         CString bmpfn;
         bmpfn.Format(_T("%s_%04u.bmp"), fn, i + 1);
         title = bmpfn.Mid(bmpfn.ReverseFind('/') + 1);
 
         // E1, E2, P, Bg
-        int c[4] = {colormap[m_img.pal[1].pal], colormap[m_img.pal[2].pal], colormap[m_img.pal[0].pal], colormap[m_img.pal[3].pal]};
+        int c[4] = {colormap[img.pal[1].pal], colormap[img.pal[2].pal], colormap[img.pal[0].pal], colormap[img.pal[3].pal]};
         c[0] ^= c[1], c[1] ^= c[0], c[0] ^= c[1];
 
         if (memcmp(pc, c, sizeof(c))) {
@@ -2026,7 +2621,7 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
         }
 
         // E1, E2, P, Bg
-        int a[4] = {m_img.pal[1].tr, m_img.pal[2].tr, m_img.pal[0].tr, m_img.pal[3].tr};
+        int a[4] = {img.pal[1].tr, img.pal[2].tr, img.pal[0].tr, img.pal[3].tr};
         a[0] ^= a[1], a[1] ^= a[0], a[0] ^= a[1];
 
         if (memcmp(pa, a, sizeof(a))) {
@@ -2044,7 +2639,7 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
         int f2 = (int)((m_size.cy == 480 ? 29.97 : 25) * (t2 % 1000) / 1000);
 
         if (t2 <= 0) {
-            continue;
+            return;
         }
         if (t1 < 0) {
             t1 = 0;
@@ -2091,7 +2686,7 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
         }
 
         if (h1 == h2 && m1 == m2 && s1 == s2 && f1 == f2) {
-            continue;
+            return;
         }
 
         str.Format(_T("%04u\t%02d:%02d:%02d:%02d\t%02d:%02d:%02d:%02d\t%s\n"),
@@ -2106,20 +2701,22 @@ bool CVobSubFile::SaveScenarist(CString fn, int delay)
             bmp.Write(&fhdr, sizeof(fhdr));
             bmp.Write(&ihdr, sizeof(ihdr));
             bmp.Write(newCusPal, sizeof(RGBQUAD) * 16);
-            bmp.Write(p4bpp, 360 * (m_size.cy - 2));
+            bmp.Write(data.data(), 360 * (m_size.cy - 2));
             bmp.Close();
 
             CompressFile(bmpfn);
         }
-    }
+    };
+
+    bool ret = ExportFrames(convert, write, progress);
 
     m_bCustomPal = bCustomPal;
     memcpy(m_cuspal, tempCusPal, sizeof(m_cuspal));
 
-    return true;
+    return ret;
 }
 
-bool CVobSubFile::SaveMaestro(CString fn, int delay)
+bool CVobSubFile::SaveMaestro(CString fn, int delay, const SaveProgressFunc& progress)
 {
     TrimExtension(fn);
 
@@ -2128,8 +2725,6 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
         return false;
     }
 
-    m_img.Invalidate();
-
     fn.Replace('\\', '/');
     CString title = fn.Mid(fn.ReverseFind('/') + 1);
 
@@ -2189,11 +2784,6 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
     memcpy(tempCusPal, m_cuspal, sizeof(tempCusPal));
     memcpy(m_cuspal, newCusPal, sizeof(m_cuspal));
 
-    CAutoVectorPtr<BYTE> p4bpp;
-    if (!p4bpp.Allocate((m_size.cy - 2) * 360)) {
-        return false;
-    }
-
     BYTE colormap[16];
     for (BYTE i = 0; i < 16; i++) {
         colormap[i] = i;
@@ -2211,42 +2801,22 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
 
     int pc[4] = {1, 1, 1, 1}, pa[4] = {15, 15, 15, 0};
 
-    CAtlArray<SubPos>& sp = m_langs[m_nLang].subpos;
-    for (size_t i = 0, k = 0; i < sp.GetCount(); i++) {
-        if (!GetFrame(i)) {
-            continue;
-        }
-
-        for (int j = 0; j < 5; j++) {
-            if (j == 4 || !m_img.pal[j].tr) {
-                j &= 3;
-                memset(p4bpp, (j << 4) | j, (m_size.cy - 2) * 360);
-                break;
-            }
-        }
-
-        for (ptrdiff_t y = std::max(m_img.rect.top + 1, 2l); y < m_img.rect.bottom - 1; y++) {
-            ASSERT(m_size.cy - y - 1 >= 0);
-            if (m_size.cy - y - 1 < 0) {
-                break;
-            }
-
-            DWORD* p = (DWORD*)&m_img.lpPixels[(y - m_img.rect.top) * m_img.rect.Width() + 1];
+    auto convert = [this](size_t, const CVobSubImage& img, std::vector<BYTE>& data) {
+        data.resize((m_size.cy - 2) * 360);
+        ConvertTo4bpp(img, m_size.cy, data.data());
+        return true;
+    };
 
-            for (ptrdiff_t x = m_img.rect.left + 1; x < m_img.rect.right - 1; x++, p++) {
-                DWORD rgb = *p & 0xffffff;
-                BYTE c = rgb == 0x0000ff ? 0 : rgb == 0xff0000 ? 1 : rgb == 0x000000 ? 2 : 3;
-                BYTE& c4bpp = p4bpp[(m_size.cy - y - 1) * 360 + (x >> 1)];
-                c4bpp = (x & 1) ? ((c4bpp & 0xf0) | c) : ((c4bpp & 0x0f) | (c << 4));
-            }
-        }
+    const CAtlArray<SubPos>& sp = m_langs[m_nLang].subpos;
+    size_t k = 0;
 
+    auto write = [&](size_t i, const CVobSubImage& img, const std::vector<BYTE>& data) {
         CString bmpfn;
         bmpfn.Format(_T("%s_%04u.bmp"), fn, i + 1);
         title = bmpfn.Mid(bmpfn.ReverseFind('/') + 1);
 
         // E1, E2, P, Bg
-        int c[4] = {colormap[m_img.pal[1].pal], colormap[m_img.pal[2].pal], colormap[m_img.pal[0].pal], colormap[m_img.pal[3].pal]};
+        int c[4] = {colormap[img.pal[1].pal], colormap[img.pal[2].pal], colormap[img.pal[0].pal], colormap[img.pal[3].pal]};
 
         if (memcmp(pc, c, sizeof(c))) {
             memcpy(pc, c, sizeof(c));
@@ -2255,7 +2825,7 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
         }
 
         // E1, E2, P, Bg
-        int a[4] = {m_img.pal[1].tr, m_img.pal[2].tr, m_img.pal[0].tr, m_img.pal[3].tr};
+        int a[4] = {img.pal[1].tr, img.pal[2].tr, img.pal[0].tr, img.pal[3].tr};
 
         if (memcmp(pa, a, sizeof(a))) {
             memcpy(pa, a, sizeof(a));
@@ -2272,7 +2842,7 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
         int f2 = (int)((m_size.cy == 480 ? 29.97 : 25) * (t2 % 1000) / 1000);
 
         if (t2 <= 0) {
-            continue;
+            return;
         }
         if (t1 < 0) {
             t1 = 0;
@@ -2319,7 +2889,7 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
         }
 
         if (h1 == h2 && m1 == m2 && s1 == s2 && f1 == f2) {
-            continue;
+            return;
         }
 
         str.Format(_T("%04u\t%02d:%02d:%02d:%02d\t%02d:%02d:%02d:%02d\t%s\n"),
@@ -2334,17 +2904,19 @@ bool CVobSubFile::SaveMaestro(CString fn, int delay)
             bmp.Write(&fhdr, sizeof(fhdr));
             bmp.Write(&ihdr, sizeof(ihdr));
             bmp.Write(newCusPal, sizeof(RGBQUAD) * 16);
-            bmp.Write(p4bpp, 360 * (m_size.cy - 2));
+            bmp.Write(data.data(), 360 * (m_size.cy - 2));
             bmp.Close();
 
             CompressFile(bmpfn);
         }
-    }
+    };
+
+    bool ret = ExportFrames(convert, write, progress);
 
     m_bCustomPal = bCustomPal;
     memcpy(m_cuspal, tempCusPal, sizeof(m_cuspal));
 
-    return true;
+    return ret;
 }
 
 //
@@ -22,6 +22,12 @@
 #pragma once
 
 #include <atlcoll.h>
+#include <list>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "VobSubImage.h"
 #include "../SubPic/SubPicProviderImpl.h"
 
@@ -99,6 +105,10 @@ public:
         CAtlArray<SubPos> subpos;
     };
 
+    // Called by Save() on the calling thread after each subtitle picture has been
+    // exported, returning false cancels the export
+    typedef std::function<bool(size_t nDone, size_t nTotal)> SaveProgressFunc;
+
 protected:
     CString m_title;
 
@@ -108,16 +118,109 @@ protected:
 
     CMemFile m_sub;
 
-    BYTE* GetPacket(size_t idx, size_t& packetSize, size_t& dataSize, size_t nLang = SIZE_T_ERROR);
+    // The .sub file is mapped in memory when possible instead of being loaded in m_sub,
+    // only a window of it is mapped at a time so that huge files don't exhaust the address space
+    HANDLE m_hSubFile;
+    HANDLE m_hSubMapping;
+    __int64 m_subFileSize;
+    const BYTE* m_pSubView;
+    __int64 m_subViewStart, m_subViewSize;
+
+    bool MapSub(CString fn);
+    void UnmapSub();
+    // Returns the 2048 bytes sector at the given position, either directly from
+    // the mapping or copied in buff, or nullptr if there is no such sector
+    const BYTE* GetSubSector(__int64 pos, BYTE* buff);
+    // Serializes the accesses to m_sub and to the mapped view
+    CCritSec m_csSub;
+
+    // The packets appended to a .sub file which is still being written are indexed
+    // as they arrive, so that the subtitle doesn't have to be reopened
+    __int64 m_subIndexPos;      // position up to which the .sub file has been indexed
+    DWORD m_dwLastIndexUpdate;
+
+    bool RemapSub(__int64 size);
+    bool GetSubPTS(__int64 pos, __int64& pts);
+    void UpdateIndex();
+
+    // Small LRU of decoded and trimmed frames per language so that seeking back or switching
+    // between streams doesn't decode the same packets again, it is also filled ahead of the
+    // playback by a background thread. Animated frames depend on the time so they aren't cached.
+    struct DecodePalette {
+        bool bCustomPal;
+        int tridx;
+        RGBQUAD orgpal[16], cuspal[4];
+    };
+    struct DecodedFrame {
+        size_t nIdx;
+        bool bForced;
+        int tCurrent;
+        CRect rect;
+        CVobSubImage::SubPal pal[4];
+        std::vector<RGBQUAD> pixels;
+
+        DecodedFrame(size_t nIdx, const CVobSubImage& img) {
+            Assign(nIdx, img);
+        }
+
+        void Assign(size_t nIdx, const CVobSubImage& img) {
+            this->nIdx = nIdx;
+            bForced = img.bForced;
+            tCurrent = img.tCurrent;
+            rect = img.rect;
+            memcpy(pal, img.pal, sizeof(pal));
+            // Reuses the current storage when it is large enough
+            pixels.assign(img.lpPixels, img.lpPixels + img.rect.Width() * img.rect.Height());
+        }
+    };
+    enum {
+        FRAME_CACHE_SIZE = 8,   // frames per language
+        PREDECODE_AHEAD  = 4    // frames decoded ahead of the current one
+    };
+
+    std::mutex m_mutexFrameCache;
+    std::array<std::list<DecodedFrame>, 32> m_frameCache;
+    DecodePalette m_frameCachePal;
+
+    std::thread m_preDecodeThread;
+    std::condition_variable m_preDecodeCV;
+    bool m_bPreDecodeExit;
+    // The frames to decode, chosen by PreDecode under the provider lock since
+    // Subresync edits the subpos fields in place while holding it
+    size_t m_nPreDecodeLang;
+    std::vector<size_t> m_preDecodeIdxs;
+
+    // The following helpers must be called with m_mutexFrameCache locked
+    void UpdateFrameCachePalette();
+    const DecodedFrame* FindFrame(size_t idx, size_t nLang);
+    void CacheFrame(size_t idx, size_t nLang, const CVobSubImage& img);
+
+    bool LookupFrame(size_t idx, size_t nLang);
+    void PreDecode(size_t idx, size_t nLang);
+    void StopPreDecode();
+    void PreDecodeThread();
+
+    // Assembles the packet in buff, which is only grown when needed so that it can be
+    // reused from one packet to another. Returns the packet or nullptr on failure.
+    BYTE* GetPacket(size_t idx, std::vector<BYTE>& buff, size_t& packetSize, size_t& dataSize, size_t nLang = SIZE_T_ERROR);
+    std::vector<BYTE> m_packet;
     const SubPos* GetFrameInfo(size_t idx, size_t nLang = SIZE_T_ERROR) const;
     bool GetFrame(size_t idx, size_t nLang = SIZE_T_ERROR, REFERENCE_TIME rt = -1);
     bool GetFrameByTimeStamp(__int64 time);
     size_t GetFrameIdxByTimeStamp(__int64 time);
 
-    bool SaveVobSub(CString fn, int delay);
-    bool SaveWinSubMux(CString fn, int delay);
-    bool SaveScenarist(CString fn, int delay);
-    bool SaveMaestro(CString fn, int delay);
+    bool SaveVobSub(CString fn, int delay, const SaveProgressFunc& progress);
+    bool SaveWinSubMux(CString fn, int delay, const SaveProgressFunc& progress);
+    bool SaveScenarist(CString fn, int delay, const SaveProgressFunc& progress);
+    bool SaveMaestro(CString fn, int delay, const SaveProgressFunc& progress);
+
+    // The frames of the current language are decoded and passed to convert() on a pool of threads,
+    // then write() is called for each of them in order on the calling thread. Returns false if the
+    // export was cancelled.
+    typedef std::function<bool(size_t i, const CVobSubImage& img, std::vector<BYTE>& data)> ExportConvertFunc;
+    typedef std::function<void(size_t i, const CVobSubImage& img, const std::vector<BYTE>& data)> ExportWriteFunc;
+    bool ExportFrames(const ExportConvertFunc& convert, const ExportWriteFunc& write, const SaveProgressFunc& progress);
+    bool DecodeFrame(size_t idx, CVobSubImage& img, std::vector<BYTE>& packet);
 
 public:
     size_t m_nLang;
@@ -137,7 +240,7 @@ public:
     };
 
     bool Open(CString fn);
-    bool Save(CString fn, int delay = 0, SubFormat sf = VobSub);
+    bool Save(CString fn, int delay = 0, SubFormat sf = VobSub, const SaveProgressFunc& progress = nullptr);
     void Close();
 
     CString GetTitle() { return m_title; }
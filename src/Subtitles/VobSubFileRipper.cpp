@@ -786,10 +786,9 @@ bool CVobSubFileRipper::Create()
 
                 sp[j].bValid = false;
                 size_t packetSize = 0, dataSize = 0;
-                if (BYTE* buff = GetPacket(j, packetSize, dataSize, i)) {
+                if (BYTE* buff = GetPacket(j, m_packet, packetSize, dataSize, i)) {
                     m_img.GetPacketInfo(buff, packetSize, dataSize);
                     sp[j].bValid = m_img.bForced;
-                    delete [] buff;
                 }
             }
 
@@ -24,14 +24,38 @@
 #include "RTS.h"
 #include <math.h>
 #include <algorithm>
+#include <emmintrin.h>
+
+// Number of nibbles of a RLE code, indexed by the byte starting at the code
+static const struct RLECodeLength {
+    BYTE nibbles[256];
+
+    RLECodeLength() {
+        for (int i = 0; i < 256; i++) {
+            nibbles[i] = i >= 0x40 ? 1 : i >= 0x10 ? 2 : i >= 0x04 ? 3 : 4;
+        }
+    }
+} s_rleCodeLength;
+
+static void FillRun(DWORD* dst, int length, DWORD color)
+{
+    if (length >= 8) {
+        __m128i c = _mm_set1_epi32(color);
+        for (; length >= 4; length -= 4, dst += 4) {
+            _mm_storeu_si128((__m128i*)dst, c);
+        }
+    }
+
+    while (length-- > 0) {
+        *dst++ = color;
+    }
+}
 
 CVobSubImage::CVobSubImage()
     : org(CSize(0, 0))
     , lpTemp1(nullptr)
     , lpTemp2(nullptr)
-    , nPlane(0)
     , bCustomPal(false)
-    , bAligned(true)
     , tridx(0)
     , orgpal(nullptr)
     , cuspal(nullptr)
@@ -111,46 +135,89 @@ bool CVobSubImage::Decode(BYTE* lpData, size_t packetSize, size_t dataSize, int
 
     lpPixels = lpTemp1;
 
-    nPlane = 0;
-    bAligned = true;
-
     this->bCustomPal = bCustomPal;
     this->orgpal = orgpal;
     this->tridx = tridx;
     this->cuspal = cuspal;
 
-    CPoint p = rect.TopLeft();
+    // The colors are resolved once instead of for every run
+    DWORD colors[4];
+    for (size_t i = 0; i < 4; i++) {
+        RGBQUAD c;
+        if (!bCustomPal) {
+            c = orgpal[pal[i].pal];
+            c.rgbReserved = (pal[i].tr << 4) | pal[i].tr;
+        } else {
+            c = cuspal[i];
+        }
+        colors[i] = *(DWORD*)&c;
+    }
+
+    const int w = rect.Width(), h = rect.Height();
+
+    // Bounding box of the visible pixels, computed while decoding so that TrimSubImage doesn't have to scan the image
+    CRect bbox(w, h, -1, -1);
+
+    // The fields are interlaced, the even lines are in the first plane and the odd lines in the second one.
+    // The positions are counted in nibbles.
+    size_t pos[2] = { nOffset[0] * 2, nOffset[1] * 2 };
+    const size_t end[2] = { nOffset[1] * 2, dataSize * 2 };
+
+    auto readByte = [&](size_t off) -> DWORD {
+        return off < packetSize ? lpData[off] : 0;
+    };
+
+    int y = 0;
 
-    size_t end[] = { nOffset[1], dataSize };
+    for (size_t plane = 0; y < h && pos[plane] < end[plane]; y++, plane = 1 - plane) {
+        DWORD* line = (DWORD*)&lpPixels[w * y];
+        int x = 0, left = w, right = -1;
+        bool bEndOfLine = false;
 
-    while (nOffset[nPlane] < end[nPlane]) {
-        DWORD code;
+        while (!bEndOfLine && pos[plane] < end[plane]) {
+            // The 16 bits starting at the current nibble contain the whole code
+            size_t off = pos[plane] >> 1;
+            DWORD bits = (readByte(off) << 16) | (readByte(off + 1) << 8) | readByte(off + 2);
+            bits = (bits >> ((pos[plane] & 1) ? 4 : 8)) & 0xffff;
 
-        if ((code = GetNibble(lpData)) >= 0x4
-                || (code = (code << 4) | GetNibble(lpData)) >= 0x10
-                || (code = (code << 4) | GetNibble(lpData)) >= 0x40
-                || (code = (code << 4) | GetNibble(lpData)) >= 0x100) {
-            DrawPixels(p, code >> 2, code & 3);
-            if ((p.x += code >> 2) < rect.right) {
-                continue;
+            int n = s_rleCodeLength.nibbles[bits >> 8];
+            DWORD code = bits >> (16 - 4 * n);
+            pos[plane] += n;
+
+            // A run of length 0 fills the rest of the line
+            int length = (n == 4 && code < 0x100) ? w - x : std::min<int>(code >> 2, w - x);
+            DWORD color = colors[code & 3];
+
+            FillRun(&line[x], length, color);
+            if (length > 0 && (color >> 24)) {
+                left = std::min(left, x);
+                right = std::max(right, x + length - 1);
             }
+
+            x += length;
+            bEndOfLine = x >= w;
         }
 
-        DrawPixels(p, rect.right - p.x, code & 3);
+        if (!bEndOfLine) {
+            // the data ended in the middle of the line
+            break;
+        }
 
-        if (!bAligned) {
-            GetNibble(lpData);    // align to byte
+        if (left <= right) {
+            bbox.left = std::min(bbox.left, (LONG)left);
+            bbox.right = std::max(bbox.right, (LONG)right);
+            bbox.top = std::min(bbox.top, (LONG)y);
+            bbox.bottom = y;
         }
 
-        p.x = rect.left;
-        p.y++;
-        nPlane = 1 - nPlane;
+        // lines start on a byte boundary
+        pos[plane] = (pos[plane] + 1) & ~1;
     }
 
-    rect.bottom = std::min(p.y, rect.bottom);
+    rect.bottom = std::min(rect.top + y, rect.bottom);
 
     if (bTrim) {
-        TrimSubImage();
+        TrimSubImage(bbox);
     }
 
     return true;
@@ -270,83 +337,8 @@ void CVobSubImage::GetPacketInfo(const BYTE* lpData, size_t packetSize, size_t d
     bAnimated = (nPal > 1 || nTr > 1);
 }
 
-BYTE CVobSubImage::GetNibble(const BYTE* lpData)
+void CVobSubImage::TrimSubImage(CRect r)
 {
-    size_t& off = nOffset[nPlane];
-    BYTE ret = lpData[off];
-    if (bAligned) {
-        ret >>= 4;
-    }
-    ret &= 0x0f;
-    bAligned = !bAligned;
-    if (bAligned) {
-        off++;
-    }
-    return ret;
-}
-
-void CVobSubImage::DrawPixels(CPoint p, int length, size_t colorId)
-{
-    if (length <= 0
-            || p.x + length < rect.left
-            || p.x >= rect.right
-            || p.y < rect.top
-            || p.y >= rect.bottom) {
-        return;
-    }
-
-    if (p.x < rect.left) {
-        p.x = rect.left;
-    }
-    if (p.x + length >= rect.right) {
-        length = rect.right - p.x;
-    }
-
-    RGBQUAD* ptr = &lpPixels[rect.Width() * (p.y - rect.top) + (p.x - rect.left)];
-
-    RGBQUAD c;
-
-    if (!bCustomPal) {
-        c = orgpal[pal[colorId].pal];
-        c.rgbReserved = (pal[colorId].tr << 4) | pal[colorId].tr;
-    } else {
-        c = cuspal[colorId];
-    }
-
-    while (length-- > 0) {
-        *ptr++ = c;
-    }
-}
-
-void CVobSubImage::TrimSubImage()
-{
-    CRect r;
-    r.left = rect.Width();
-    r.top = rect.Height();
-    r.right = 0;
-    r.bottom = 0;
-
-    RGBQUAD* ptr = lpTemp1;
-
-    for (int j = 0, y = rect.Height(); j < y; j++) {
-        for (int i = 0, x = rect.Width(); i < x; i++, ptr++) {
-            if (ptr->rgbReserved) {
-                if (r.top > j) {
-                    r.top = j;
-                }
-                if (r.bottom < j) {
-                    r.bottom = j;
-                }
-                if (r.left > i) {
-                    r.left = i;
-                }
-                if (r.right < i) {
-                    r.right = i;
-                }
-            }
-        }
-    }
-
     if (r.left > r.right || r.top > r.bottom) {
         return;
     }
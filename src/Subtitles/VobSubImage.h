@@ -45,18 +45,16 @@ private:
     RGBQUAD* lpTemp1;
     RGBQUAD* lpTemp2;
 
-    size_t nOffset[2], nPlane;
+    size_t nOffset[2];
     bool bCustomPal;
-    bool bAligned;
     int tridx;
     RGBQUAD* orgpal /*[16]*/, * cuspal /*[4]*/;
 
     bool Alloc(int w, int h);
     void Free();
 
-    BYTE GetNibble(const BYTE* lpData);
-    void DrawPixels(CPoint p, int length, size_t colorId);
-    void TrimSubImage();
+    // r is the bounding box of the visible pixels, in image coordinates and with inclusive bounds
+    void TrimSubImage(CRect r);
 
 public:
     size_t nLang, nIdx;
@@ -69,11 +69,36 @@ STDMETHODIMP CAsyncFileReader::NonDelegatingQueryInterface(REFIID riid, void** p
 
 STDMETHODIMP CAsyncFileReader::SyncRead(LONGLONG llPosition, LONG lLength, BYTE* pBuffer)
 {
+    if (m_strFiles.GetCount() == 1) {
+        // Positional read, it doesn't depend on the file pointer so it only
+        // has to keep the handle from being reopened under it
+        Concurrency::reader_writer_lock::scoped_lock_read lock(m_rwHandle);
+
+        if ((ULONGLONG)llPosition + lLength > GetLength()) {
+            return E_FAIL;
+        }
+        if (ReadAt(llPosition, pBuffer, lLength) == (UINT)lLength) {
+            return S_OK;
+        }
+        // the loop below reopens the file until the read works or we are asked to stop
+        InterlockedExchange(&m_lOsError, (LONG)GetLastError());
+    }
+
+    // The parts of a playlist are opened one at a time so Seek
+    // and Read must not be interleaved with another read
+    CAutoLock cAutoLock(&m_csRead);
+
     do {
         try {
             if ((ULONGLONG)llPosition + lLength > GetLength()) {
                 return E_FAIL;    // strange, but the Seek below can return llPosition even if the file is not that big (?)
             }
+            if (m_strFiles.GetCount() == 1) {
+                if (ReadAt(llPosition, pBuffer, lLength) != (UINT)lLength) {
+                    AfxThrowFileException(CFileException::genericException, (LONG)GetLastError(), m_strFileName);
+                }
+                return S_OK;
+            }
             if ((ULONGLONG)llPosition != Seek(llPosition, begin)) {
                 return E_FAIL;
             }
@@ -92,9 +117,11 @@ STDMETHODIMP CAsyncFileReader::SyncRead(LONGLONG llPosition, LONG lLength, BYTE*
 
             return S_OK;
         } catch (CFileException* e) {
-            m_lOsError = e->m_lOsError;
+            InterlockedExchange(&m_lOsError, e->m_lOsError);
             e->Delete();
             Sleep(1);
+            // wait for the positional reads which are still using the handle
+            Concurrency::reader_writer_lock::scoped_lock lock(m_rwHandle);
             CString fn = m_strFileName;
             try {
                 Close();
@@ -137,6 +164,154 @@ STDMETHODIMP_(LPCTSTR) CAsyncFileReader::GetFileName()
     return m_nCurPart != -1 ? m_strFiles[m_nCurPart] : m_strFiles[0];
 }
 
+//
+// CAsyncMappedFileReader
+//
+
+CAsyncMappedFileReader::CAsyncMappedFileReader(CString fn, HRESULT& hr)
+    : CAsyncFileReader(fn, hr)
+    , m_hMapping(nullptr)
+    , m_llMappedLength(0)
+{
+    if (SUCCEEDED(hr) && m_len > 0) {
+        // Failing to map the file isn't fatal, all reads will just go through ReadFile
+        m_hMapping = CreateFileMapping(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_hMapping) {
+            m_llMappedLength = m_len;
+        }
+    }
+}
+
+CAsyncMappedFileReader::~CAsyncMappedFileReader()
+{
+    for (const auto& view : m_views) {
+        ASSERT(view.nBorrowed == 0);
+        UnmapViewOfFile(view.pData);
+    }
+    if (m_hMapping) {
+        CloseHandle(m_hMapping);
+    }
+}
+
+bool CAsyncMappedFileReader::CanMap(CString fn)
+{
+    CPath root(fn);
+    return root.StripToRoot() && GetDriveType(root) == DRIVE_FIXED;
+}
+
+STDMETHODIMP CAsyncMappedFileReader::NonDelegatingQueryInterface(REFIID riid, void** ppv)
+{
+    CheckPointer(ppv, E_POINTER);
+
+    return
+        QI(IMappedFile)
+        __super::NonDelegatingQueryInterface(riid, ppv);
+}
+
+// Reading a mapped view raises an exception instead of returning an error when the I/O fails
+static bool CopyMappedData(BYTE* pDst, const BYTE* pSrc, size_t nSize)
+{
+    __try {
+        memcpy(pDst, pSrc, nSize);
+    } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return false;
+    }
+    return true;
+}
+
+// IAsyncReader
+
+STDMETHODIMP CAsyncMappedFileReader::SyncRead(LONGLONG llPosition, LONG lLength, BYTE* pBuffer)
+{
+    LONG lDone = 0;
+
+    while (lDone < lLength) {
+        LONG lChunk = (LONG)std::min<ULONGLONG>(lLength - lDone, VIEW_OVERLAP);
+        const BYTE* pData = BorrowPointer(llPosition + lDone, lChunk);
+        if (!pData) {
+            break;
+        }
+        bool bCopied = CopyMappedData(pBuffer + lDone, pData, lChunk);
+        ReturnPointer(pData);
+        if (!bCopied) {
+            break;
+        }
+        lDone += lChunk;
+    }
+
+    if (lDone < lLength) {
+        // Not mapped or the mapping failed, use a normal read instead
+        return __super::SyncRead(llPosition + lDone, lLength - lDone, pBuffer + lDone);
+    }
+
+    return S_OK;
+}
+
+// IMappedFile
+
+STDMETHODIMP_(const BYTE*) CAsyncMappedFileReader::BorrowPointer(LONGLONG llPosition, LONG lLength)
+{
+    if (!m_hMapping || llPosition < 0 || lLength < 0 || ULONGLONG(llPosition) + lLength > m_llMappedLength) {
+        return nullptr;
+    }
+
+    ULONGLONG llStart = ULONGLONG(llPosition) / VIEW_STEP * VIEW_STEP;
+    if (ULONGLONG(llPosition) + lLength > llStart + VIEW_STEP + VIEW_OVERLAP) {
+        return nullptr;
+    }
+
+    CAutoLock cAutoLock(&m_csViews);
+
+    auto it = std::find_if(m_views.begin(), m_views.end(), [llStart](const View& view) {
+        return view.llStart == llStart;
+    });
+
+    if (it != m_views.end()) {
+        m_views.splice(m_views.begin(), m_views, it);
+    } else {
+        // Unmap the least recently used views which aren't borrowed anymore
+        while (m_views.size() >= MAX_VIEWS) {
+            auto itUnused = std::find_if(m_views.rbegin(), m_views.rend(), [](const View& view) {
+                return view.nBorrowed == 0;
+            });
+            if (itUnused == m_views.rend()) {
+                break;
+            }
+            UnmapViewOfFile(itUnused->pData);
+            m_views.erase(std::next(itUnused).base());
+        }
+
+        View view;
+        view.llStart = llStart;
+        view.nSize = (size_t)std::min(VIEW_STEP + VIEW_OVERLAP, m_llMappedLength - llStart);
+        view.pData = (const BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, DWORD(llStart >> 32), DWORD(llStart), view.nSize);
+        view.nBorrowed = 0;
+        if (!view.pData) {
+            return nullptr;
+        }
+        m_views.push_front(view);
+    }
+
+    View& view = m_views.front();
+    view.nBorrowed++;
+
+    return view.pData + (ULONGLONG(llPosition) - llStart);
+}
+
+STDMETHODIMP_(void) CAsyncMappedFileReader::ReturnPointer(const BYTE* pData)
+{
+    CAutoLock cAutoLock(&m_csViews);
+
+    auto it = std::find_if(m_views.begin(), m_views.end(), [pData](const View& view) {
+        return view.pData <= pData && pData < view.pData + view.nSize;
+    });
+
+    ASSERT(it != m_views.end() && it->nBorrowed > 0);
+    if (it != m_views.end()) {
+        it->nBorrowed--;
+    }
+}
+
 //
 // CAsyncUrlReader
 //
@@ -22,6 +22,8 @@
 #pragma once
 
 #include "MultiFiles.h"
+#include <concrt.h>
+#include <list>
 
 interface __declspec(uuid("6DDB4EE7-45A0-4459-A508-BD77B32C91B2"))
 ISyncReader :
@@ -39,12 +41,27 @@ public IUnknown {
     STDMETHOD_(LPCTSTR, GetFileName)() PURE;
 };
 
+interface __declspec(uuid("75C6C1D7-9683-44B3-8F1D-10CF556050EC"))
+IMappedFile :
+public IUnknown {
+    // Gives direct access to lLength bytes of the file starting at llPosition, or
+    // returns nullptr if that part of the file isn't mapped. The pointer stays
+    // valid until it is given back with ReturnPointer. Reading through it raises
+    // EXCEPTION_IN_PAGE_ERROR on an I/O error, the callers must handle it with SEH.
+    STDMETHOD_(const BYTE*, BorrowPointer)(LONGLONG llPosition, LONG lLength) PURE;
+    STDMETHOD_(void, ReturnPointer)(const BYTE* pData) PURE;
+};
+
 class CAsyncFileReader : public CUnknown, public CMultiFiles, public IAsyncReader, public ISyncReader, public IFileHandle
 {
 protected:
     ULONGLONG m_len;
     HANDLE m_hBreakEvent;
-    LONG m_lOsError; // CFileException::m_lOsError
+    volatile LONG m_lOsError; // CFileException::m_lOsError, only changed through InterlockedExchange
+    CCritSec m_csRead; // serializes the reads of the playlists, which switch between files
+    // Held shared by the positional reads, which don't take m_csRead, and
+    // exclusively while the file is closed and opened again after an error
+    Concurrency::reader_writer_lock m_rwHandle;
 
 public:
     CAsyncFileReader(CString fn, HRESULT& hr);
@@ -74,7 +91,7 @@ public:
 
     STDMETHODIMP_(void) SetBreakEvent(HANDLE hBreakEvent) { m_hBreakEvent = hBreakEvent; }
     STDMETHODIMP_(bool) HasErrors() { return m_lOsError != 0; }
-    STDMETHODIMP_(void) ClearErrors() { m_lOsError = 0; }
+    STDMETHODIMP_(void) ClearErrors() { InterlockedExchange(&m_lOsError, 0); }
     STDMETHODIMP_(void) SetPTSOffset(REFERENCE_TIME* rtPTSOffset) { m_pCurrentPTSOffset = rtPTSOffset; };
 
     // IFileHandle
@@ -84,6 +101,51 @@ public:
 
 };
 
+class CAsyncMappedFileReader : public CAsyncFileReader, public IMappedFile
+{
+    // The file is mapped by views of VIEW_STEP bytes, each one overlapping the next
+    // one by VIEW_OVERLAP bytes so that short ranges never span two views.
+#ifdef _WIN64
+    static const ULONGLONG VIEW_STEP = 1024 * 1024 * 1024;
+#else
+    static const ULONGLONG VIEW_STEP = 64 * 1024 * 1024;
+#endif
+    static const ULONGLONG VIEW_OVERLAP = 4 * 1024 * 1024;
+    static const size_t MAX_VIEWS = 4;
+
+    struct View {
+        ULONGLONG llStart;
+        size_t nSize;
+        const BYTE* pData;
+        int nBorrowed;
+    };
+
+    HANDLE m_hMapping;
+    ULONGLONG m_llMappedLength;
+    CCritSec m_csViews;
+    std::list<View> m_views; // most recently used first
+
+public:
+    CAsyncMappedFileReader(CString fn, HRESULT& hr);
+    virtual ~CAsyncMappedFileReader();
+
+    // Files on network or removable drives are not mapped because
+    // an I/O error on a mapped view raises an exception
+    static bool CanMap(CString fn);
+
+    DECLARE_IUNKNOWN;
+    STDMETHODIMP NonDelegatingQueryInterface(REFIID riid, void** ppv);
+
+    // IAsyncReader
+
+    STDMETHODIMP SyncRead(LONGLONG llPosition, LONG lLength, BYTE* pBuffer);
+
+    // IMappedFile
+
+    STDMETHODIMP_(const BYTE*) BorrowPointer(LONGLONG llPosition, LONG lLength);
+    STDMETHODIMP_(void) ReturnPointer(const BYTE* pData);
+};
+
 class CAsyncUrlReader : public CAsyncFileReader, protected CAMThread
 {
     CString m_url, m_fn;
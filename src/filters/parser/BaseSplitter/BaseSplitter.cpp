@@ -26,69 +26,490 @@
 #include "../../switcher/AudioSwitcher/AudioSwitcher.h"
 #include "BaseSplitter.h"
 #include <algorithm>
+#include <atomic>
 
 
+//
+// CPacketPool
+//
+
+struct CPacketPool::BlockHeader {
+    union {
+        BlockHeader* pNext; // while the block is idle
+        size_t nSize;       // for the blocks which don't belong to a size class
+    };
+    size_t nClass;
+};
+
+namespace
+{
+    struct SharedList {
+        CCritSec cs;
+        CPacketPool::BlockHeader* pFree = nullptr;
+    };
+
+    SharedList s_sharedLists[CPacketPool::CLASS_COUNT];
+    std::atomic<int> s_nIdleBlocks(0);
+    std::atomic<size_t> s_nIdleSize(0);
+    std::atomic<UINT64> s_nAllocs(0), s_nHits(0);
+    std::atomic<int> s_nUsers(0);
+    const DWORD s_tlsIndex = TlsAlloc();
+
+    size_t GetClass(size_t size)
+    {
+        if (size <= CPacketPool::MIN_BLOCK_SIZE) {
+            return 0;
+        }
+
+        // 2^b < size <= 2^(b+1), split into 4 steps
+        DWORD b;
+        _BitScanReverse(&b, DWORD(size - 1));
+        size_t step = size_t(1) << (b - 2);
+        size_t k = (size - (size_t(1) << b) + step - 1) / step;
+
+        return 1 + (b - 6) * 4 + (k - 1);
+    }
+
+    size_t GetClassSize(size_t nClass)
+    {
+        if (nClass == 0) {
+            return CPacketPool::MIN_BLOCK_SIZE;
+        }
+
+        size_t b = 6 + (nClass - 1) / 4;
+        size_t k = 1 + (nClass - 1) % 4;
+
+        return (size_t(1) << b) + k * (size_t(1) << (b - 2));
+    }
+
+    CPacketPool::CThreadCache* GetThreadCache()
+    {
+        return s_tlsIndex != TLS_OUT_OF_INDEXES ? (CPacketPool::CThreadCache*)TlsGetValue(s_tlsIndex) : nullptr;
+    }
+
+    void PushShared(size_t nClass, CPacketPool::BlockHeader* pBlock)
+    {
+        SharedList& list = s_sharedLists[nClass];
+        CAutoLock cAutoLock(&list.cs);
+        pBlock->pNext = list.pFree;
+        list.pFree = pBlock;
+    }
+}
+
+CPacketPool::CThreadCache::CThreadCache()
+    : m_pPrevious(GetThreadCache())
+{
+    ZeroMemory(m_pFree, sizeof(m_pFree));
+    ZeroMemory(m_nFree, sizeof(m_nFree));
+
+    if (s_tlsIndex != TLS_OUT_OF_INDEXES) {
+        TlsSetValue(s_tlsIndex, this);
+    }
+}
+
+CPacketPool::CThreadCache::~CThreadCache()
+{
+    for (size_t nClass = 0; nClass < CLASS_COUNT; nClass++) {
+        while (BlockHeader* pBlock = m_pFree[nClass]) {
+            m_pFree[nClass] = pBlock->pNext;
+            PushShared(nClass, pBlock);
+        }
+    }
+
+    if (s_tlsIndex != TLS_OUT_OF_INDEXES) {
+        TlsSetValue(s_tlsIndex, m_pPrevious);
+    }
+}
+
+void* CPacketPool::Alloc(size_t size)
+{
+    s_nAllocs++;
+
+    if (size > MAX_BLOCK_SIZE) {
+        BlockHeader* pBlock = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+        if (!pBlock) {
+            return nullptr;
+        }
+        pBlock->nSize = size;
+        pBlock->nClass = CLASS_COUNT;
+        return pBlock + 1;
+    }
+
+    size_t nClass = GetClass(size);
+    BlockHeader* pBlock = nullptr;
+
+    if (CThreadCache* pCache = GetThreadCache()) {
+        if (!pCache->m_pFree[nClass] && GetClassSize(nClass) <= THREAD_CACHE_MAX_BLOCK_SIZE) {
+            // take a batch of blocks from the shared list at once
+            SharedList& list = s_sharedLists[nClass];
+            CAutoLock cAutoLock(&list.cs);
+            while (list.pFree && pCache->m_nFree[nClass] < THREAD_CACHE_BLOCKS) {
+                BlockHeader* pFree = list.pFree;
+                list.pFree = pFree->pNext;
+                pFree->pNext = pCache->m_pFree[nClass];
+                pCache->m_pFree[nClass] = pFree;
+                pCache->m_nFree[nClass]++;
+            }
+        }
+        if ((pBlock = pCache->m_pFree[nClass]) != nullptr) {
+            pCache->m_pFree[nClass] = pBlock->pNext;
+            pCache->m_nFree[nClass]--;
+        }
+    }
+
+    if (!pBlock) {
+        SharedList& list = s_sharedLists[nClass];
+        CAutoLock cAutoLock(&list.cs);
+        if ((pBlock = list.pFree) != nullptr) {
+            list.pFree = pBlock->pNext;
+        }
+    }
+
+    if (pBlock) {
+        s_nHits++;
+        s_nIdleBlocks--;
+        s_nIdleSize -= GetClassSize(nClass);
+    } else if (!(pBlock = (BlockHeader*)malloc(sizeof(BlockHeader) + GetClassSize(nClass)))) {
+        return nullptr;
+    }
+
+    pBlock->nClass = nClass;
+    return pBlock + 1;
+}
+
+void CPacketPool::Free(void* p)
+{
+    if (!p) {
+        return;
+    }
+
+    BlockHeader* pBlock = (BlockHeader*)p - 1;
+    size_t nClass = pBlock->nClass;
+    size_t nSize = nClass < CLASS_COUNT ? GetClassSize(nClass) : 0;
+
+    if (!nSize || s_nIdleSize + nSize > MAX_IDLE_SIZE) {
+        free(pBlock);
+        return;
+    }
+
+    s_nIdleBlocks++;
+    s_nIdleSize += nSize;
+
+    CThreadCache* pCache = GetThreadCache();
+    if (pCache && nSize <= THREAD_CACHE_MAX_BLOCK_SIZE && pCache->m_nFree[nClass] < THREAD_CACHE_BLOCKS) {
+        pBlock->pNext = pCache->m_pFree[nClass];
+        pCache->m_pFree[nClass] = pBlock;
+        pCache->m_nFree[nClass]++;
+    } else {
+        PushShared(nClass, pBlock);
+    }
+}
+
+size_t CPacketPool::GetBlockSize(const void* p)
+{
+    const BlockHeader* pBlock = (const BlockHeader*)p - 1;
+    return pBlock->nClass < CLASS_COUNT ? GetClassSize(pBlock->nClass) : pBlock->nSize;
+}
+
+void CPacketPool::AddUser()
+{
+    s_nUsers++;
+}
+
+void CPacketPool::RemoveUser()
+{
+    if (--s_nUsers == 0) {
+        Trim();
+    }
+}
+
+void CPacketPool::Trim()
+{
+    for (size_t nClass = 0; nClass < CLASS_COUNT; nClass++) {
+        SharedList& list = s_sharedLists[nClass];
+        CAutoLock cAutoLock(&list.cs);
+        while (BlockHeader* pBlock = list.pFree) {
+            list.pFree = pBlock->pNext;
+            s_nIdleBlocks--;
+            s_nIdleSize -= GetClassSize(nClass);
+            free(pBlock);
+        }
+    }
+}
+
+void CPacketPool::GetStatus(int& blocks, int& size, int& hitRate)
+{
+    UINT64 nAllocs = s_nAllocs;
+    blocks = s_nIdleBlocks;
+    size = (int)s_nIdleSize;
+    hitRate = nAllocs ? int(s_nHits * 100 / nAllocs) : 0;
+}
+
+// Destroyed when the module is unloaded, after the shared lists were filled for the
+// last time. Releases what is left in them and the TLS slot of the thread caches.
+struct CPacketPoolCleanup {
+    ~CPacketPoolCleanup() {
+        CPacketPool::Trim();
+        if (s_tlsIndex != TLS_OUT_OF_INDEXES) {
+            TlsFree(s_tlsIndex);
+        }
+    }
+};
+
+static CPacketPoolCleanup s_packetPoolCleanup;
+
+//
+// CPacketData
+//
+
+bool CPacketData::SetCount(size_t nNewSize, int nGrowBy)
+{
+    if (nNewSize == 0) {
+        RemoveAll();
+        return true;
+    }
+
+    if (nNewSize > m_nMaxSize) {
+        BYTE* pNewData = (BYTE*)CPacketPool::Alloc(nNewSize + std::max(nGrowBy, 0));
+        if (!pNewData) {
+            return false;
+        }
+        if (m_pData) {
+            memcpy(pNewData, m_pData, m_nSize);
+            CPacketPool::Free(m_pData);
+        }
+        m_pData = pNewData;
+        m_nMaxSize = CPacketPool::GetBlockSize(pNewData);
+    }
+
+    m_nSize = nNewSize;
+    return true;
+}
+
+void CPacketData::RemoveAll()
+{
+    CPacketPool::Free(m_pData);
+    m_pData = nullptr;
+    m_nSize = m_nMaxSize = 0;
+}
+
+//
+// Packet
+//
+
+void* Packet::operator new(size_t size)
+{
+    void* p = CPacketPool::Alloc(size);
+    if (!p) {
+        AfxThrowMemoryException();
+    }
+    return p;
+}
+
+void* Packet::operator new(size_t size, LPCSTR /*lpszFileName*/, int /*nLine*/)
+{
+    return operator new(size);
+}
+
+void Packet::operator delete(void* p)
+{
+    CPacketPool::Free(p);
+}
+
+void Packet::operator delete(void* p, LPCSTR /*lpszFileName*/, int /*nLine*/)
+{
+    CPacketPool::Free(p);
+}
+
 //
 // CPacketQueue
 //
 
-CPacketQueue::CPacketQueue() : m_size(0)
+CPacketQueue::CPacketQueue(size_t nMinCapacity)
+    : m_nHead(0)
+    , m_nTail(0)
+    , m_nCount(0)
+    , m_nSize(0)
+    , m_nGeneration(0)
+{
+    size_t nCapacity = 16;
+    while (nCapacity < nMinCapacity) {
+        nCapacity <<= 1;
+    }
+
+    m_slots.reset(DEBUG_NEW Slot[nCapacity]);
+    m_nMask = nCapacity - 1;
+
+    for (size_t i = 0; i < nCapacity; i++) {
+        m_slots[i].state = SLOT_EMPTY;
+        m_slots[i].p = nullptr;
+        m_slots[i].nGeneration = 0;
+    }
+}
+
+CPacketQueue::~CPacketQueue()
 {
+    for (size_t i = m_nHead; i != m_nTail; i++) {
+        delete m_slots[i & m_nMask].p;
+    }
 }
 
-void CPacketQueue::Add(CAutoPtr<Packet> p)
+bool CPacketQueue::Add(CAutoPtr<Packet>& p, UINT nGeneration)
 {
-    CAutoLock cAutoLock(this);
+    size_t nHead = m_nHead;
+    size_t nTail = m_nTail;
+
+    if (p && p->bAppendable && !p->bDiscontinuity && !p->pmt
+            && p->rtStart == Packet::INVALID_TIME
+            && nHead != nTail) {
+        // the last queued packet can only be extended as long as the consumer didn't take it
+        Slot& tail = m_slots[(nTail - 1) & m_nMask];
+        int state = SLOT_READY;
+        if (tail.nGeneration == nGeneration && tail.state.compare_exchange_strong(state, SLOT_APPENDING)) {
+            Packet* pTail = tail.p;
+            bool fAppended = false;
 
+            if (pTail && pTail->rtStart != Packet::INVALID_TIME) {
+                size_t oldsize = pTail->GetCount();
+                size_t newsize = pTail->GetCount() + p->GetCount();
+                if (pTail->SetCount(newsize, std::max(1024, (int)newsize))) { // doubles the reserved buffer size
+                    memcpy(pTail->GetData() + oldsize, p->GetData(), p->GetCount());
+                    m_nSize += p->GetDataSize();
+                    fAppended = true;
+                }
+            }
+
+            tail.state = SLOT_READY;
+
+            if (fAppended) {
+                p.Free();
+                return true;
+            }
+        }
+    }
+
+    if (nTail - nHead > m_nMask) {
+        return false;
+    }
+
+    Slot& slot = m_slots[nTail & m_nMask];
+    m_nCount++;
     if (p) {
-        m_size += p->GetDataSize();
-
-        if (p->bAppendable && !p->bDiscontinuity && !p->pmt
-                && p->rtStart == Packet::INVALID_TIME
-                && !IsEmpty() && GetTail()->rtStart != Packet::INVALID_TIME) {
-            Packet* tail = GetTail();
-            size_t oldsize = tail->GetCount();
-            size_t newsize = tail->GetCount() + p->GetCount();
-            tail->SetCount(newsize, std::max(1024, (int)newsize)); // doubles the reserved buffer size
-            memcpy(tail->GetData() + oldsize, p->GetData(), p->GetCount());
-            /*
-            GetTail()->Append(*p); // too slow
-            */
-            return;
+        m_nSize += p->GetDataSize();
+    }
+    slot.p = p.Detach();
+    slot.nGeneration = nGeneration;
+    slot.state = SLOT_READY;
+    m_nTail = nTail + 1;
+
+    m_evAdded.Set();
+
+    return true;
+}
+
+bool CPacketQueue::Remove(CAutoPtr<Packet>& p)
+{
+    ASSERT(!p);
+
+    for (;;) {
+        size_t nHead = m_nHead;
+        if (nHead == m_nTail) {
+            return false;
+        }
+
+        Slot& slot = m_slots[nHead & m_nMask];
+        int state = SLOT_READY;
+        while (!slot.state.compare_exchange_weak(state, SLOT_TAKEN)) {
+            ASSERT(state == SLOT_APPENDING || state == SLOT_READY);
+            state = SLOT_READY;
+            SwitchToThread(); // the producer is appending to this packet, it won't take long
+        }
+
+        CAutoPtr<Packet> pPacket(slot.p);
+        bool fFlushed = slot.nGeneration != m_nGeneration;
+        slot.p = nullptr;
+        slot.state = SLOT_EMPTY;
+        m_nHead = nHead + 1;
+
+        m_nCount--;
+        if (pPacket) {
+            m_nSize -= pPacket->GetDataSize();
+        }
+
+        if (!fFlushed) {
+            p = pPacket;
+            return true;
         }
     }
+}
 
-    AddTail(p);
+void CPacketQueue::Flush()
+{
+    m_nGeneration++;
+    m_evAdded.Set(); // let the consumer drop the flushed packets
 }
 
-CAutoPtr<Packet> CPacketQueue::Remove()
+void CPacketQueue::Drain()
 {
-    CAutoLock cAutoLock(this);
-    ASSERT(__super::GetCount() > 0);
-    CAutoPtr<Packet> p = RemoveHead();
-    if (p) {
-        m_size -= p->GetDataSize();
+    CAutoPtr<Packet> p;
+    while (Remove(p)) {
+        p.Free();
     }
-    return p;
 }
 
-void CPacketQueue::RemoveAll()
+//
+// CPacketSample
+//
+
+CPacketSample::CPacketSample(CBaseAllocator* pAllocator, CAutoPtr<Packet> p, HRESULT* phr)
+    : CMediaSample(NAME("CPacketSample"), pAllocator, phr, p->GetData(), (LONG)p->GetCount())
+    , m_p(p)
 {
-    CAutoLock cAutoLock(this);
-    m_size = 0;
-    __super::RemoveAll();
 }
 
-int CPacketQueue::GetCount()
+STDMETHODIMP_(ULONG) CPacketSample::Release()
 {
-    CAutoLock cAutoLock(this);
-    return (int)__super::GetCount();
+    LONG lRef = InterlockedDecrement(&m_cRef);
+    ASSERT(lRef >= 0);
+
+    if (lRef == 0) {
+        delete this;
+    }
+
+    return (ULONG)lRef;
 }
 
-int CPacketQueue::GetSize()
+//
+// CPacketAllocator
+//
+
+CPacketAllocator::CPacketAllocator(HRESULT* phr)
+    : CMemAllocator(NAME("CPacketAllocator"), nullptr, phr)
 {
-    CAutoLock cAutoLock(this);
-    return m_size;
+}
+
+HRESULT CPacketAllocator::GetPacketSample(CAutoPtr<Packet> p, IMediaSample** ppSample)
+{
+    CheckPointer(ppSample, E_POINTER);
+    *ppSample = nullptr;
+
+    {
+        CAutoLock cObjectLock(this);
+        if (!m_bCommitted || m_bDecommitInProgress) {
+            return VFW_E_NOT_COMMITTED;
+        }
+    }
+
+    HRESULT hr = S_OK;
+    CPacketSample* pSample = DEBUG_NEW CPacketSample(this, p, &hr);
+    if (FAILED(hr)) {
+        delete pSample;
+        return hr;
+    }
+
+    (*ppSample = pSample)->AddRef();
+
+    return S_OK;
 }
 
 //
@@ -193,11 +614,17 @@ STDMETHODIMP CBaseSplitterInputPin::EndFlush()
 
 CBaseSplitterOutputPin::CBaseSplitterOutputPin(CAtlArray<CMediaType>& mts, LPCWSTR pName, CBaseFilter* pFilter, CCritSec* pLock, HRESULT* phr, int nBuffers, int QueueMaxPackets)
     : CBaseOutputPin(NAME("CBaseSplitterOutputPin"), pFilter, pLock, phr, pName)
+    , m_queue(QueueMaxPackets * 2 + 2)
     , m_hrDeliver(S_OK) // just in case it were asked before the worker thread could be created and reset it
     , m_fFlushing(false)
     , m_fFlushed(false)
     , m_eEndFlush(TRUE)
     , m_QueueMaxPackets(QueueMaxPackets)
+    , m_nQueueMaxPackets(QueueMaxPackets)
+    , m_nQueueMaxSize(MAXPACKETSIZE)
+    , m_nQueueMinPackets(MINPACKETS)
+    , m_nQueueMinSize(MINPACKETSIZE)
+    , m_fPacketSamples(false)
     , m_rtStart(0)
 {
     m_mts.Copy(mts);
@@ -206,11 +633,17 @@ CBaseSplitterOutputPin::CBaseSplitterOutputPin(CAtlArray<CMediaType>& mts, LPCWS
 
 CBaseSplitterOutputPin::CBaseSplitterOutputPin(LPCWSTR pName, CBaseFilter* pFilter, CCritSec* pLock, HRESULT* phr, int nBuffers, int QueueMaxPackets)
     : CBaseOutputPin(NAME("CBaseSplitterOutputPin"), pFilter, pLock, phr, pName)
+    , m_queue(QueueMaxPackets * 2 + 2)
     , m_hrDeliver(S_OK) // just in case it were asked before the worker thread could be created and reset it
     , m_fFlushing(false)
     , m_fFlushed(false)
     , m_eEndFlush(TRUE)
     , m_QueueMaxPackets(QueueMaxPackets)
+    , m_nQueueMaxPackets(QueueMaxPackets)
+    , m_nQueueMaxSize(MAXPACKETSIZE)
+    , m_nQueueMinPackets(MINPACKETS)
+    , m_nQueueMinSize(MINPACKETSIZE)
+    , m_fPacketSamples(false)
     , m_rtStart(0)
 {
     m_nBuffers = std::max(nBuffers, 1);
@@ -246,6 +679,54 @@ HRESULT CBaseSplitterOutputPin::SetName(LPCWSTR pName)
     return S_OK;
 }
 
+HRESULT CBaseSplitterOutputPin::InitAllocator(IMemAllocator** ppAlloc)
+{
+    CheckPointer(ppAlloc, E_POINTER);
+
+    HRESULT hr = S_OK;
+    CPacketAllocator* pAllocator = DEBUG_NEW CPacketAllocator(&hr);
+    if (FAILED(hr)) {
+        delete pAllocator;
+        return hr;
+    }
+
+    return pAllocator->QueryInterface(IID_PPV_ARGS(ppAlloc));
+}
+
+HRESULT CBaseSplitterOutputPin::DecideAllocator(IMemInputPin* pPin, IMemAllocator** ppAlloc)
+{
+    CheckPointer(pPin, E_POINTER);
+    CheckPointer(ppAlloc, E_POINTER);
+
+    m_fPacketSamples = false;
+    *ppAlloc = nullptr;
+
+    ALLOCATOR_PROPERTIES prop;
+    ZeroMemory(&prop, sizeof(prop));
+    pPin->GetAllocatorRequirements(&prop);
+
+    // Our own allocator is offered first since it lets us hand the packets over
+    // as they are. The samples then point into the packet buffers, which have
+    // no prefix and are only aligned like any other heap block.
+    if (prop.cbPrefix == 0 && prop.cbAlign <= MEMORY_ALLOCATION_ALIGNMENT) {
+        prop.cbAlign = 1;
+
+        if (SUCCEEDED(InitAllocator(ppAlloc))) {
+            if (SUCCEEDED(DecideBufferSize(*ppAlloc, &prop))
+                    && SUCCEEDED(pPin->NotifyAllocator(*ppAlloc, FALSE))) {
+                m_fPacketSamples = true;
+                return S_OK;
+            }
+
+            (*ppAlloc)->Release();
+            *ppAlloc = nullptr;
+        }
+    }
+
+    // the downstream filter refused it, let it pick the allocator and copy the packets
+    return __super::DecideAllocator(pPin, ppAlloc);
+}
+
 HRESULT CBaseSplitterOutputPin::DecideBufferSize(IMemAllocator* pAlloc, ALLOCATOR_PROPERTIES* pProperties)
 {
     ASSERT(pAlloc);
@@ -337,7 +818,7 @@ HRESULT CBaseSplitterOutputPin::DeliverBeginFlush()
     m_fFlushed = false;
     m_fFlushing = true;
     m_hrDeliver = S_FALSE;
-    m_queue.RemoveAll();
+    m_queue.Flush();
     HRESULT hr = IsConnected() ? GetConnected()->BeginFlush() : S_OK;
     if (S_OK != hr) {
         m_eEndFlush.Set();
@@ -386,6 +867,25 @@ int CBaseSplitterOutputPin::QueueSize()
     return m_queue.GetSize();
 }
 
+bool CBaseSplitterOutputPin::IsQueueDrying(int nDivisor)
+{
+    return m_queue.GetCount() < m_nQueueMinPackets / nDivisor || m_queue.GetSize() < m_nQueueMinSize / nDivisor;
+}
+
+void CBaseSplitterOutputPin::UpdateQueueTargets()
+{
+    double dSecs = (static_cast<CBaseSplitterFilter*>(m_pFilter))->GetBufferDuration() / 10000000.0;
+
+    // the hard limits of QueuePacket stay the upper bound, the ring isn't larger than that
+    int nMaxPackets = (int)std::min(m_BitRate.nCurrentPacketRate * dSecs, m_QueueMaxPackets * 2.0);
+    int nMaxSize = (int)std::min(m_BitRate.nCurrentBitRate / 8.0 * dSecs, MAXPACKETSIZE * 3.0 / 2);
+
+    m_nQueueMaxPackets = std::max(nMaxPackets, MINPACKETS);
+    m_nQueueMaxSize = std::max(nMaxSize, MINPACKETSIZE);
+    m_nQueueMinPackets = m_nQueueMaxPackets / 4;
+    m_nQueueMinSize = m_nQueueMaxSize / 4;
+}
+
 HRESULT CBaseSplitterOutputPin::QueueEndOfStream()
 {
     return QueuePacket(CAutoPtr<Packet>()); // NULL means EndOfStream
@@ -397,19 +897,25 @@ HRESULT CBaseSplitterOutputPin::QueuePacket(CAutoPtr<Packet> p)
         return S_FALSE;
     }
 
+    CBaseSplitterFilter* pFilter = static_cast<CBaseSplitterFilter*>(m_pFilter);
+
     while (S_OK == m_hrDeliver
             && ((m_queue.GetCount() > (m_QueueMaxPackets * 2) || m_queue.GetSize() > (MAXPACKETSIZE * 3 / 2))
-                || ((m_queue.GetCount() > m_QueueMaxPackets || m_queue.GetSize() > MAXPACKETSIZE) && !(static_cast<CBaseSplitterFilter*>(m_pFilter))->IsAnyPinDrying()))) {
-        Sleep(10);
+                || ((m_queue.GetCount() > m_nQueueMaxPackets || m_queue.GetSize() > m_nQueueMaxSize) && !pFilter->IsAnyPinDrying()))) {
+        WaitForSingleObject(pFilter->GetRefillEvent(), 10);
     }
 
-    if (S_OK != m_hrDeliver) {
-        return m_hrDeliver;
+    for (;;) {
+        // DeliverBeginFlush sets m_hrDeliver before flushing the queue, so read them in the opposite order
+        UINT nGeneration = m_queue.GetGeneration();
+        if (S_OK != m_hrDeliver) {
+            return m_hrDeliver;
+        }
+        if (m_queue.Add(p, nGeneration)) {
+            return m_hrDeliver;
+        }
+        Sleep(1); // only happens while the pin drops the packets of an earlier flush
     }
-
-    m_queue.Add(p);
-
-    return m_hrDeliver;
 }
 
 bool CBaseSplitterOutputPin::IsDiscontinuous()
@@ -461,11 +967,13 @@ DWORD CBaseSplitterOutputPin::ThreadProc()
         GetConnected()->EndFlush();
     }
 
-    for (;;) {
-        Sleep(1);
+    HANDLE hWait[] = {GetRequestHandle(), m_queue.GetAddedEvent()};
 
+    for (;;) {
         DWORD cmd;
         if (CheckRequest(&cmd)) {
+            // the packets which were flushed or not delivered yet would otherwise stay queued until the next run
+            m_queue.Drain();
             m_hThread = nullptr;
             cmd = GetRequest();
             Reply(S_OK);
@@ -473,37 +981,33 @@ DWORD CBaseSplitterOutputPin::ThreadProc()
             return 0;
         }
 
-        int cnt = 0;
-        do {
-            CAutoPtr<Packet> p;
+        CAutoPtr<Packet> p;
+        if (!m_queue.Remove(p)) {
+            WaitForMultipleObjects(_countof(hWait), hWait, FALSE, INFINITE);
+            continue;
+        }
 
-            {
-                CAutoLock cAutoLock(&m_queue);
-                if ((cnt = m_queue.GetCount()) > 0) {
-                    p = m_queue.Remove();
-                }
-            }
+        if (!IsDiscontinuous() && IsQueueDrying()) {
+            (static_cast<CBaseSplitterFilter*>(m_pFilter))->RequestRefill();
+        }
 
-            if (S_OK == m_hrDeliver && cnt > 0) {
-                ASSERT(!m_fFlushing);
+        if (S_OK == m_hrDeliver) {
+            ASSERT(!m_fFlushing);
 
-                m_fFlushed = false;
+            m_fFlushed = false;
 
-                // flushing can still start here, to release a blocked deliver call
+            // flushing can still start here, to release a blocked deliver call
 
-                HRESULT hr = p
-                             ? DeliverPacket(p)
-                             : DeliverEndOfStream();
+            HRESULT hr = p
+                         ? DeliverPacket(p)
+                         : DeliverEndOfStream();
 
-                m_eEndFlush.Wait(); // .. so we have to wait until it is done
+            m_eEndFlush.Wait(); // .. so we have to wait until it is done
 
-                if (hr != S_OK && !m_fFlushed) { // and only report the error in m_hrDeliver if we didn't flush the stream
-                    // CAutoLock cAutoLock(&m_csQueueLock);
-                    m_hrDeliver = hr;
-                    break;
-                }
+            if (hr != S_OK && !m_fFlushed) { // and only report the error in m_hrDeliver if we didn't flush the stream
+                m_hrDeliver = hr;
             }
-        } while (--cnt > 0);
+        }
     }
 }
 
@@ -518,11 +1022,13 @@ HRESULT CBaseSplitterOutputPin::DeliverPacket(CAutoPtr<Packet> p)
     }
 
     m_BitRate.nBytesSinceLastDeliverTime += nBytes;
+    m_BitRate.nPacketsSinceLastDeliverTime++;
 
     if (p->rtStart != Packet::INVALID_TIME) {
         if (m_BitRate.rtLastDeliverTime == Packet::INVALID_TIME) {
             m_BitRate.rtLastDeliverTime = p->rtStart;
             m_BitRate.nBytesSinceLastDeliverTime = 0;
+            m_BitRate.nPacketsSinceLastDeliverTime = 0;
         }
 
         if (m_BitRate.rtLastDeliverTime + 10000000 < p->rtStart) {
@@ -533,6 +1039,7 @@ HRESULT CBaseSplitterOutputPin::DeliverPacket(CAutoPtr<Packet> p)
             dSecs = rtDiff / 10000000.0;
             dBits = 8.0 * m_BitRate.nBytesSinceLastDeliverTime;
             m_BitRate.nCurrentBitRate = (DWORD)(dBits / dSecs);
+            m_BitRate.nCurrentPacketRate = (DWORD)(m_BitRate.nPacketsSinceLastDeliverTime / dSecs);
 
             m_BitRate.rtTotalTimeDelivered += rtDiff;
             m_BitRate.nTotalBytesDelivered += m_BitRate.nBytesSinceLastDeliverTime;
@@ -543,6 +1050,9 @@ HRESULT CBaseSplitterOutputPin::DeliverPacket(CAutoPtr<Packet> p)
 
             m_BitRate.rtLastDeliverTime = p->rtStart;
             m_BitRate.nBytesSinceLastDeliverTime = 0;
+            m_BitRate.nPacketsSinceLastDeliverTime = 0;
+
+            UpdateQueueTargets();
             /*
                         TRACE(_T("[%d] c: %d kbps, a: %d kbps\n"),
                             p->TrackNumber,
@@ -558,13 +1068,20 @@ HRESULT CBaseSplitterOutputPin::DeliverPacket(CAutoPtr<Packet> p)
         }
     }
 
+    Packet* pPacket = p; // still valid after p was handed over to a packet sample, the sample owns it then
+
     do {
         CComPtr<IMediaSample> pSample;
-        if (S_OK != (hr = GetDeliveryBuffer(&pSample, nullptr, nullptr, 0))) {
+
+        if (m_fPacketSamples) {
+            if (S_OK != (hr = static_cast<CPacketAllocator*>(m_pAllocator)->GetPacketSample(p, &pSample))) {
+                break;
+            }
+        } else if (S_OK != (hr = GetDeliveryBuffer(&pSample, nullptr, nullptr, 0))) {
             break;
         }
 
-        if (nBytes > pSample->GetSize()) {
+        if (!m_fPacketSamples && nBytes > pSample->GetSize()) {
             pSample.Release();
 
             ALLOCATOR_PROPERTIES props, actual;
@@ -596,47 +1113,49 @@ HRESULT CBaseSplitterOutputPin::DeliverPacket(CAutoPtr<Packet> p)
             }
         }
 
-        if (p->pmt) {
-            pSample->SetMediaType(p->pmt);
-            p->bDiscontinuity = true;
+        if (pPacket->pmt) {
+            pSample->SetMediaType(pPacket->pmt);
+            pPacket->bDiscontinuity = true;
 
             CAutoLock cAutoLock(m_pLock);
             m_mts.RemoveAll();
-            m_mts.Add(*p->pmt);
+            m_mts.Add(*pPacket->pmt);
         }
 
-        bool fTimeValid = p->rtStart != Packet::INVALID_TIME;
+        bool fTimeValid = pPacket->rtStart != Packet::INVALID_TIME;
 
 #if defined(_DEBUG) && 0
         TRACE(_T("[%d]: d%d s%d p%d, b=%d, [%20I64d - %20I64d]\n"),
-              p->TrackNumber,
-              p->bDiscontinuity, p->bSyncPoint, fTimeValid && p->rtStart < 0,
-              nBytes, p->rtStart, p->rtStop);
+              pPacket->TrackNumber,
+              pPacket->bDiscontinuity, pPacket->bSyncPoint, fTimeValid && pPacket->rtStart < 0,
+              nBytes, pPacket->rtStart, pPacket->rtStop);
 #endif
 
-        ASSERT(!p->bSyncPoint || fTimeValid);
+        ASSERT(!pPacket->bSyncPoint || fTimeValid);
 
-        BYTE* pData = nullptr;
-        if (S_OK != (hr = pSample->GetPointer(&pData)) || !pData) {
-            break;
+        if (!m_fPacketSamples) {
+            BYTE* pData = nullptr;
+            if (S_OK != (hr = pSample->GetPointer(&pData)) || !pData) {
+                break;
+            }
+            memcpy(pData, pPacket->GetData(), nBytes);
         }
-        memcpy(pData, p->GetData(), nBytes);
         if (S_OK != (hr = pSample->SetActualDataLength(nBytes))) {
             break;
         }
-        if (S_OK != (hr = pSample->SetTime(fTimeValid ? &p->rtStart : nullptr, fTimeValid ? &p->rtStop : nullptr))) {
+        if (S_OK != (hr = pSample->SetTime(fTimeValid ? &pPacket->rtStart : nullptr, fTimeValid ? &pPacket->rtStop : nullptr))) {
             break;
         }
         if (S_OK != (hr = pSample->SetMediaTime(nullptr, nullptr))) {
             break;
         }
-        if (S_OK != (hr = pSample->SetDiscontinuity(p->bDiscontinuity))) {
+        if (S_OK != (hr = pSample->SetDiscontinuity(pPacket->bDiscontinuity))) {
             break;
         }
-        if (S_OK != (hr = pSample->SetSyncPoint(p->bSyncPoint))) {
+        if (S_OK != (hr = pSample->SetSyncPoint(pPacket->bSyncPoint))) {
             break;
         }
-        if (S_OK != (hr = pSample->SetPreroll(fTimeValid && p->rtStart < 0))) {
+        if (S_OK != (hr = pSample->SetPreroll(fTimeValid && pPacket->rtStart < 0))) {
             break;
         }
         if (S_OK != (hr = Deliver(pSample))) {
@@ -785,6 +1304,8 @@ CBaseSplitterFilter::CBaseSplitterFilter(LPCTSTR pName, LPUNKNOWN pUnk, HRESULT*
     , m_fFlushing(false)
     , m_priority(THREAD_PRIORITY_NORMAL)
     , m_QueueMaxPackets(QueueMaxPackets)
+    , m_rtBufferDuration(0)
+    , m_fLocalSource(false)
     , m_rtLastStart(_I64_MIN)
     , m_rtLastStop(_I64_MIN)
 {
@@ -793,6 +1314,8 @@ CBaseSplitterFilter::CBaseSplitterFilter(LPCTSTR pName, LPUNKNOWN pUnk, HRESULT*
     }
 
     m_pInput.Attach(DEBUG_NEW CBaseSplitterInputPin(NAME("CBaseSplitterInputPin"), this, this, phr));
+
+    CPacketPool::AddUser();
 }
 
 CBaseSplitterFilter::~CBaseSplitterFilter()
@@ -801,6 +1324,9 @@ CBaseSplitterFilter::~CBaseSplitterFilter()
 
     CAMThread::CallWorker(CMD_EXIT);
     CAMThread::Close();
+
+    // the other splitters of the process may still be using the pool
+    CPacketPool::RemoveUser();
 }
 
 STDMETHODIMP CBaseSplitterFilter::NonDelegatingQueryInterface(REFIID riid, void** ppv)
@@ -821,6 +1347,8 @@ STDMETHODIMP CBaseSplitterFilter::NonDelegatingQueryInterface(REFIID riid, void*
         QI2(IAMExtendedSeeking)
         QI(IKeyFrameInfo)
         QI(IBufferInfo)
+        QI(IBufferPoolInfo)
+        QI(IBufferControl)
         QI(IPropertyBag)
         QI(IPropertyBag2)
         QI(IDSMPropertyBag)
@@ -952,6 +1480,8 @@ void CBaseSplitterFilter::DeliverEndFlush()
 
 DWORD CBaseSplitterFilter::ThreadProc()
 {
+    CPacketPool::CThreadCache packetCache;
+
     if (m_pSyncReader) {
         m_pSyncReader->SetBreakEvent(GetRequestHandle());
     }
@@ -1091,9 +1621,9 @@ bool CBaseSplitterFilter::IsAnyPinDrying()
         CBaseSplitterOutputPin* pPin = m_pActivePins.GetNext(pos);
         int count = pPin->QueueCount();
         int size = pPin->QueueSize();
-        if (!pPin->IsDiscontinuous() && (count < MINPACKETS || size < MINPACKETSIZE)) {
+        if (!pPin->IsDiscontinuous() && pPin->IsQueueDrying()) {
             //          if (m_priority != THREAD_PRIORITY_ABOVE_NORMAL && (count < MINPACKETS/3 || size < MINPACKETSIZE/3))
-            if (m_priority != THREAD_PRIORITY_BELOW_NORMAL && (count < MINPACKETS / 3 || size < MINPACKETSIZE / 3)) {
+            if (m_priority != THREAD_PRIORITY_BELOW_NORMAL && pPin->IsQueueDrying(3)) {
                 // SetThreadPriority(m_hThread, m_priority = THREAD_PRIORITY_ABOVE_NORMAL);
                 POSITION pos2 = m_pOutputs.GetHeadPosition();
                 while (pos2) {
@@ -1247,8 +1777,13 @@ STDMETHODIMP CBaseSplitterFilter::Load(LPCOLESTR pszFileName, const AM_MEDIA_TYP
 
     if (BuildPlaylist(pszFileName, Items)) {
         pAsyncReader = (IAsyncReader*)DEBUG_NEW CAsyncFileReader(Items, hr);
+        m_fLocalSource = true;
+    } else if (CAsyncMappedFileReader::CanMap(pszFileName)) {
+        pAsyncReader = (IAsyncReader*)DEBUG_NEW CAsyncMappedFileReader(CString(pszFileName), hr);
+        m_fLocalSource = true;
     } else {
         pAsyncReader = (IAsyncReader*)DEBUG_NEW CAsyncFileReader(CString(pszFileName), hr);
+        m_fLocalSource = false;
     }
 
     if (FAILED(hr)
@@ -1635,3 +2170,30 @@ STDMETHODIMP_(DWORD) CBaseSplitterFilter::GetPriority()
 {
     return m_priority;
 }
+
+// IBufferPoolInfo
+
+STDMETHODIMP CBaseSplitterFilter::GetPoolStatus(int& blocks, int& size, int& hitRate)
+{
+    CPacketPool::GetStatus(blocks, size, hitRate);
+    return S_OK;
+}
+
+// IBufferControl
+
+STDMETHODIMP CBaseSplitterFilter::SetBufferDuration(REFERENCE_TIME rtDuration)
+{
+    if (rtDuration < 0) {
+        return E_INVALIDARG;
+    }
+    m_rtBufferDuration = rtDuration;
+    return S_OK;
+}
+
+STDMETHODIMP_(REFERENCE_TIME) CBaseSplitterFilter::GetBufferDuration()
+{
+    if (m_rtBufferDuration > 0) {
+        return m_rtBufferDuration;
+    }
+    return m_fLocalSource ? BUFFERDURATION : BUFFERDURATION * 2;
+}
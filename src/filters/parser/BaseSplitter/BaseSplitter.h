@@ -24,8 +24,12 @@
 #include <atlbase.h>
 #include <atlcoll.h>
 #include <qnetwork.h>
+#include <atomic>
+#include <memory>
 #include "IKeyFrameInfo.h"
 #include "IBufferInfo.h"
+#include "IBufferPoolInfo.h"
+#include "IBufferControl.h"
 #include "IBitRateInfo.h"
 #include "AsyncReader.h"
 #include "../../../DSUtil/DSMPropertyBag.h"
@@ -35,8 +39,96 @@
 #define MINPACKETSIZE 256*1024  // Beliyaal: Changed the min packet size to allow Bluray playback over network
 #define MAXPACKETS    2000
 #define MAXPACKETSIZE 128*1024*1024
+#define BUFFERDURATION 50000000i64 // default depth of the queues in time, doubled for sources which aren't on a local fixed drive
+
+// Size-class pool for the packets and their payloads, so that the packets which
+// the demux thread creates and the delivery threads delete are recycled instead
+// of going through the heap every time. Freed blocks go to a shared list per
+// size class. The demux thread registers a cache which it refills from these
+// lists several blocks at a time.
+class CPacketPool
+{
+public:
+    enum {
+        MIN_BLOCK_SIZE = 64,
+        MAX_BLOCK_SIZE = 8 * 1024 * 1024, // larger blocks are always taken from the heap
+        CLASS_COUNT = 1 + 17 * 4,         // 4 classes per power of two between both sizes
+        THREAD_CACHE_BLOCKS = 32,
+        THREAD_CACHE_MAX_BLOCK_SIZE = 64 * 1024,
+        MAX_IDLE_SIZE = 64 * 1024 * 1024
+    };
+
+    struct BlockHeader;
+
+    // Registers a cache for the calling thread for its lifetime, only worth it
+    // for the threads allocating the packets. The blocks it holds are handed
+    // back to the shared lists when it is destroyed.
+    class CThreadCache
+    {
+        friend class CPacketPool;
+
+        CThreadCache* m_pPrevious;
+        BlockHeader* m_pFree[CLASS_COUNT];
+        int m_nFree[CLASS_COUNT];
+
+    public:
+        CThreadCache();
+        ~CThreadCache();
+    };
+
+    static void* Alloc(size_t size);
+    static void Free(void* p);
+    static size_t GetBlockSize(const void* p);
+
+    // The pool is shared by all the splitters of the process. Each one registers
+    // for its lifetime, the idle blocks are released when the last one goes away.
+    static void AddUser();
+    static void RemoveUser();
+
+    // process-wide numbers, they cover every splitter using the pool
+    static void GetStatus(int& blocks, int& size, int& hitRate);
+
+private:
+    // releases the idle blocks of the shared lists
+    static void Trim();
+
+    friend struct CPacketPoolCleanup;
+};
 
-class Packet : public CAtlArray<BYTE>
+// Minimal replacement for CAtlArray<BYTE> taking its buffer from CPacketPool.
+// Like with CAtlArray, the bytes added by SetCount are not initialized.
+class CPacketData
+{
+    BYTE* m_pData;
+    size_t m_nSize, m_nMaxSize;
+
+    CPacketData(const CPacketData&) = delete;
+    CPacketData& operator=(const CPacketData&) = delete;
+
+public:
+    CPacketData() : m_pData(nullptr), m_nSize(0), m_nMaxSize(0) {}
+    ~CPacketData() { RemoveAll(); }
+
+    BYTE* GetData() { return m_pData; }
+    const BYTE* GetData() const { return m_pData; }
+    size_t GetCount() const { return m_nSize; }
+    bool IsEmpty() const { return m_nSize == 0; }
+
+    BYTE& operator[](size_t i) {
+        ASSERT(i < m_nSize);
+        return m_pData[i];
+    }
+    const BYTE& operator[](size_t i) const {
+        ASSERT(i < m_nSize);
+        return m_pData[i];
+    }
+
+    // nGrowBy is the number of bytes reserved beyond nNewSize when the buffer has to grow
+    bool SetCount(size_t nNewSize, int nGrowBy = -1);
+    void RemoveAll();
+};
+
+class Packet : public CPacketData
 {
 public:
     DWORD TrackNumber;
@@ -63,20 +155,74 @@ public:
         SetCount(len);
         memcpy(GetData(), ptr, len);
     }
+
+    static void* operator new(size_t size);
+    static void* operator new(size_t size, LPCSTR lpszFileName, int nLine); // DEBUG_NEW
+    static void operator delete(void* p);
+    static void operator delete(void* p, LPCSTR lpszFileName, int nLine);
 };
 
+// Bounded ring handing the packets over from the demux thread, its only
+// producer, to the delivery thread of the pin, its only consumer, without
+// taking a lock. Flush may be called from any thread, the packets queued
+// before it are dropped by the consumer instead of being delivered.
 class CPacketQueue
-    : public CCritSec
-    , protected CAutoPtrList<Packet>
 {
-    int m_size;
+    enum { SLOT_EMPTY, SLOT_READY, SLOT_TAKEN, SLOT_APPENDING };
+
+    struct Slot {
+        std::atomic<int> state;
+        Packet* p;
+        UINT nGeneration;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_nMask;
+    std::atomic<size_t> m_nHead, m_nTail;
+    std::atomic<int> m_nCount, m_nSize;
+    std::atomic<UINT> m_nGeneration;
+    CAMEvent m_evAdded;
 
 public:
-    CPacketQueue();
-    void Add(CAutoPtr<Packet> p);
-    CAutoPtr<Packet> Remove();
-    void RemoveAll();
-    int GetCount(), GetSize();
+    CPacketQueue(size_t nMinCapacity);
+    ~CPacketQueue();
+
+    // producer side, fails when the ring is full, p is left untouched then.
+    // nGeneration is the value GetGeneration returned before the producer made
+    // sure the queue wasn't being flushed, so that a packet which is added
+    // while a flush starts is dropped as well.
+    bool Add(CAutoPtr<Packet>& p, UINT nGeneration);
+    // consumer side, fails when the ring is empty, p is null for the end of stream
+    bool Remove(CAutoPtr<Packet>& p);
+    void Flush();
+    // consumer side, drops everything that is still queued
+    void Drain();
+
+    UINT GetGeneration() const { return m_nGeneration; }
+    HANDLE GetAddedEvent() { return m_evAdded; }
+    int GetCount() const { return m_nCount; }
+    int GetSize() const { return m_nSize; }
+};
+
+// Media sample which owns a packet and exposes its payload directly, so
+// that it doesn't have to be copied into an allocator buffer
+class CPacketSample : public CMediaSample
+{
+    CAutoPtr<Packet> m_p;
+
+public:
+    CPacketSample(CBaseAllocator* pAllocator, CAutoPtr<Packet> p, HRESULT* phr);
+
+    // the sample isn't recycled by the allocator, it is deleted with its packet instead
+    STDMETHODIMP_(ULONG) Release();
+};
+
+class CPacketAllocator : public CMemAllocator
+{
+public:
+    CPacketAllocator(HRESULT* phr);
+
+    HRESULT GetPacketSample(CAutoPtr<Packet> p, IMediaSample** ppSample);
 };
 
 class CBaseSplitterFilter;
@@ -139,13 +285,24 @@ private:
         UINT64 nTotalBytesDelivered         = 0;
         REFERENCE_TIME rtTotalTimeDelivered = 0;
         UINT64 nBytesSinceLastDeliverTime   = 0;
+        UINT64 nPacketsSinceLastDeliverTime = 0;
         REFERENCE_TIME rtLastDeliverTime    = Packet::INVALID_TIME;
         DWORD nCurrentBitRate               = 0;
         DWORD nAverageBitRate               = 0;
+        DWORD nCurrentPacketRate            = 0;
     } m_BitRate;
 
     int m_QueueMaxPackets;
 
+    // Queue targets derived from the measured rates and the buffer duration of the
+    // filter. Until the rates are known the static limits are used.
+    std::atomic<int> m_nQueueMaxPackets, m_nQueueMaxSize;
+    std::atomic<int> m_nQueueMinPackets, m_nQueueMinSize;
+    void UpdateQueueTargets();
+
+    // true when downstream accepted our CPacketAllocator, packets are then delivered without being copied
+    bool m_fPacketSamples;
+
 protected:
     REFERENCE_TIME m_rtStart;
 
@@ -191,6 +348,8 @@ public:
 
     HRESULT SetName(LPCWSTR pName);
 
+    HRESULT InitAllocator(IMemAllocator** ppAlloc);
+    HRESULT DecideAllocator(IMemInputPin* pPin, IMemAllocator** ppAlloc);
     HRESULT DecideBufferSize(IMemAllocator* pAlloc, ALLOCATOR_PROPERTIES* pProperties);
     HRESULT CheckMediaType(const CMediaType* pmt);
     HRESULT GetMediaType(int iPosition, CMediaType* pmt);
@@ -219,6 +378,7 @@ public:
 
     int QueueCount();
     int QueueSize();
+    bool IsQueueDrying(int nDivisor = 1);
     HRESULT QueueEndOfStream();
     HRESULT QueuePacket(CAutoPtr<Packet> p);
 
@@ -248,6 +408,8 @@ class CBaseSplitterFilter
     , public IAMExtendedSeeking
     , public IKeyFrameInfo
     , public IBufferInfo
+    , public IBufferPoolInfo
+    , public IBufferControl
 {
     CCritSec m_csPinMap;
     CAtlMap<DWORD, CBaseSplitterOutputPin*> m_pPinMap;
@@ -296,6 +458,10 @@ protected:
 
     int m_QueueMaxPackets;
 
+    REFERENCE_TIME m_rtBufferDuration;
+    bool m_fLocalSource;
+    CAMEvent m_evRefill;
+
 protected:
     enum { CMD_EXIT, CMD_SEEK };
     DWORD ThreadProc();
@@ -317,6 +483,10 @@ public:
 
     bool IsAnyPinDrying();
 
+    // called by the output pins when their queue runs low, wakes up the demux thread if it waits for them
+    void RequestRefill() { m_evRefill.Set(); }
+    HANDLE GetRefillEvent() { return m_evRefill; }
+
     HRESULT BreakConnect(PIN_DIRECTION dir, CBasePin* pPin);
     HRESULT CompleteConnect(PIN_DIRECTION dir, CBasePin* pPin);
 
@@ -413,4 +583,13 @@ public:
     STDMETHODIMP_(int) GetCount();
     STDMETHODIMP GetStatus(int i, int& samples, int& size);
     STDMETHODIMP_(DWORD) GetPriority();
+
+    // IBufferPoolInfo
+
+    STDMETHODIMP GetPoolStatus(int& blocks, int& size, int& hitRate);
+
+    // IBufferControl
+
+    STDMETHODIMP SetBufferDuration(REFERENCE_TIME rtDuration);
+    STDMETHODIMP_(REFERENCE_TIME) GetBufferDuration();
 };
@@ -22,6 +22,7 @@
 #include "stdafx.h"
 #include "BaseSplitterFile.h"
 #include "../../../DSUtil/DSUtil.h"
+#include <intrin.h>
 
 //
 // CBaseSplitterFile
@@ -29,9 +30,15 @@
 
 CBaseSplitterFile::CBaseSplitterFile(IAsyncReader* pAsyncReader, HRESULT& hr, int cachelen, bool fRandomAccess, bool fStreaming)
     : m_pAsyncReader(pAsyncReader)
-    , m_cachepos(0)
-    , m_cachelen(0)
+    , m_pMappedFile(pAsyncReader)
     , m_cachetotal(0)
+    , m_dwCacheUse(0)
+    , m_lastReadEnd(-1)
+    , m_consumePos(0)
+    , m_readAheadPos(-1)
+    , m_bStopReadAhead(false)
+    , m_nNextIndexRange(0)
+    , m_bStopIndex(false)
     , m_fStreaming(false)
     , m_fRandomAccess(false)
     , m_pos(0)
@@ -64,15 +71,37 @@ CBaseSplitterFile::CBaseSplitterFile(IAsyncReader* pAsyncReader, HRESULT& hr, in
     hr = S_OK;
 }
 
+CBaseSplitterFile::~CBaseSplitterFile()
+{
+    StopIndexBuilder();
+    StopReadAhead();
+}
+
 bool CBaseSplitterFile::SetCacheSize(int cachelen)
 {
-    m_pCache.Free();
+    // The read-ahead thread must not be filling the windows we are about to free
+    StopReadAhead();
+
+    m_cache.clear();
     m_cachetotal = 0;
-    if (!m_pCache.Allocate((size_t)cachelen)) {
+    m_lastReadEnd = -1;
+    m_readAheadPos = -1;
+
+    if (cachelen < 0) {
+        return false;
+    }
+
+    try {
+        m_cache.resize(CACHE_WINDOWS);
+        for (auto& window : m_cache) {
+            window.data.resize((size_t)cachelen);
+        }
+    } catch (CMemoryException* e) {
+        e->Delete();
+        m_cache.clear();
         return false;
     }
     m_cachetotal = cachelen;
-    m_cachelen = 0;
     return true;
 }
 
@@ -123,36 +152,66 @@ HRESULT CBaseSplitterFile::Read(BYTE* pData, __int64 len)
         }
     }
 
-    if (m_cachetotal == 0 || !m_pCache) {
+    // Reading from a mapped file is a plain copy, caching it would only add another one
+    if (m_cachetotal == 0 || m_cache.empty() || m_pMappedFile && m_pos + len <= GetLength()) {
         hr = m_pAsyncReader->SyncRead(m_pos, (long)len, pData);
         m_pos += len;
         return hr;
     }
 
-    BYTE* pCache = m_pCache;
+    // Only read ahead while the file is parsed sequentially, seeking cancels it.
+    // ByteRead seeks back over the bytes left in the bit buffer, it doesn't count.
+    bool bSequential = (m_pos <= m_lastReadEnd && m_pos + (__int64)sizeof(m_bitbuff) >= m_lastReadEnd);
 
-    if (m_cachepos <= m_pos && m_pos < m_cachepos + m_cachelen) {
-        __int64 minlen = std::min(len, m_cachelen - (m_pos - m_cachepos));
+    std::unique_lock<std::mutex> lock(m_mutexCache);
 
-        memcpy(pData, &pCache[m_pos - m_cachepos], (size_t)minlen);
-
-        len -= minlen;
-        m_pos += minlen;
-        pData += minlen;
+    m_consumePos = m_pos;
+    if (!bSequential) {
+        m_readAheadPos = -1;
     }
 
-    while (len > m_cachetotal) {
-        hr = m_pAsyncReader->SyncRead(m_pos, (long)m_cachetotal, pData);
-        if (S_OK != hr) {
-            return hr;
+    while (len > 0) {
+        CacheWindow* pWindow = FindCacheWindow(m_pos);
+
+        if (pWindow && pWindow->bLoading) {
+            // Being read ahead, wait for it rather than reading it twice
+            m_cacheCV.wait(lock);
+            continue;
         }
 
-        len -= m_cachetotal;
-        m_pos += m_cachetotal;
-        pData += m_cachetotal;
-    }
+        if (pWindow) {
+            __int64 minlen = std::min(len, pWindow->pos + pWindow->len - m_pos);
+
+            memcpy(pData, &pWindow->data[(size_t)(m_pos - pWindow->pos)], (size_t)minlen);
+            pWindow->dwLastUse = ++m_dwCacheUse;
+
+            len -= minlen;
+            m_pos += minlen;
+            pData += minlen;
+            m_consumePos = m_pos;
+
+            if (bSequential && m_pos == pWindow->pos + pWindow->len) {
+                RequestReadAhead(m_pos);
+            }
+            continue;
+        }
+
+        if (len > m_cachetotal) {
+            // Large reads which aren't cached go directly to the destination
+            lock.unlock();
+            hr = m_pAsyncReader->SyncRead(m_pos, (long)m_cachetotal, pData);
+            lock.lock();
+            if (S_OK != hr) {
+                return hr;
+            }
+
+            len -= m_cachetotal;
+            m_pos += m_cachetotal;
+            pData += m_cachetotal;
+            m_consumePos = m_pos;
+            continue;
+        }
 
-    while (len > 0) {
         __int64 tmplen = GetLength();
         __int64 maxlen = std::min(tmplen - m_pos, m_cachetotal);
         __int64 minlen = std::min(len, maxlen);
@@ -160,46 +219,344 @@ HRESULT CBaseSplitterFile::Read(BYTE* pData, __int64 len)
             return S_FALSE;
         }
 
-        hr = m_pAsyncReader->SyncRead(m_pos, (long)maxlen, pCache);
+        pWindow = GetFreeCacheWindow(false);
+        ASSERT(pWindow);
+        pWindow->pos = m_pos;
+        pWindow->len = maxlen;
+        pWindow->bLoading = true;
+
+        lock.unlock();
+        hr = m_pAsyncReader->SyncRead(m_pos, (long)maxlen, pWindow->data.data());
+        lock.lock();
+
+        pWindow->bLoading = false;
+        m_cacheCV.notify_all();
         if (S_OK != hr) {
+            pWindow->len = 0;
             return hr;
         }
 
-        m_cachepos = m_pos;
-        m_cachelen = maxlen;
+        if (bSequential) {
+            RequestReadAhead(m_pos + maxlen);
+        }
+    }
 
-        memcpy(pData, pCache, (size_t)minlen);
+    m_lastReadEnd = m_pos;
 
-        len -= minlen;
-        m_pos += minlen;
-        pData += minlen;
+    return hr;
+}
+
+CBaseSplitterFile::CacheWindow* CBaseSplitterFile::FindCacheWindow(__int64 pos)
+{
+    CacheWindow* pLoading = nullptr;
+
+    for (auto& window : m_cache) {
+        if (window.pos <= pos && pos < window.pos + window.len) {
+            if (!window.bLoading) {
+                return &window;
+            }
+            pLoading = &window;
+        }
     }
 
-    return hr;
+    return pLoading;
+}
+
+CBaseSplitterFile::CacheWindow* CBaseSplitterFile::GetFreeCacheWindow(bool bReadAhead)
+{
+    __int64 readAheadEnd = m_readAheadPos + READAHEAD_WINDOWS * m_cachetotal;
+    CacheWindow* pFree = nullptr;
+
+    for (auto& window : m_cache) {
+        if (window.bLoading) {
+            continue;
+        }
+        if (window.len == 0) {
+            return &window;
+        }
+        // The read-ahead must not evict what the demuxer hasn't read yet
+        if (bReadAhead && window.pos + window.len > m_consumePos && window.pos < readAheadEnd) {
+            continue;
+        }
+        if (!pFree || window.dwLastUse < pFree->dwLastUse) {
+            pFree = &window;
+        }
+    }
+
+    return pFree;
+}
+
+void CBaseSplitterFile::RequestReadAhead(__int64 pos)
+{
+    // Growing files are left alone since their length isn't known
+    if (m_fStreaming || !m_fRandomAccess) {
+        return;
+    }
+
+    m_readAheadPos = pos;
+    if (!m_readAheadThread.joinable()) {
+        m_readAheadThread = std::thread([this] { ReadAheadThread(); });
+    }
+    m_cacheCV.notify_all();
+}
+
+void CBaseSplitterFile::StopReadAhead()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutexCache);
+        m_bStopReadAhead = true;
+    }
+    m_cacheCV.notify_all();
+
+    if (m_readAheadThread.joinable()) {
+        m_readAheadThread.join();
+    }
+    m_bStopReadAhead = false;
+}
+
+void CBaseSplitterFile::ReadAheadThread()
+{
+    SetThreadName(DWORD(-1), "Splitter Read-ahead Thread");
+
+    std::unique_lock<std::mutex> lock(m_mutexCache);
+
+    while (!m_bStopReadAhead) {
+        // Look for the first part of the read-ahead range which isn't cached yet
+        CacheWindow* pWindow = nullptr;
+        __int64 pos = m_readAheadPos;
+
+        if (pos >= 0) {
+            __int64 end = std::min(m_readAheadPos + READAHEAD_WINDOWS * m_cachetotal, m_len);
+            for (CacheWindow* pCached; pos < end && (pCached = FindCacheWindow(pos)) != nullptr;) {
+                pos = pCached->pos + pCached->len;
+            }
+            if (pos < end) {
+                pWindow = GetFreeCacheWindow(true);
+            }
+        }
+
+        if (!pWindow) {
+            m_cacheCV.wait(lock);
+            continue;
+        }
+
+        __int64 len = std::min(m_len - pos, m_cachetotal);
+        pWindow->pos = pos;
+        pWindow->len = len;
+        pWindow->bLoading = true;
+        pWindow->dwLastUse = ++m_dwCacheUse;
+
+        lock.unlock();
+        HRESULT hr = m_pAsyncReader->SyncRead(pos, (long)len, pWindow->data.data());
+        lock.lock();
+
+        pWindow->bLoading = false;
+        if (S_OK != hr) {
+            // Let the demuxer deal with the error when it gets there
+            pWindow->len = 0;
+            m_readAheadPos = -1;
+        }
+        m_cacheCV.notify_all();
+    }
+}
+
+bool CBaseSplitterFile::StartIndexBuilder()
+{
+    StopIndexBuilder();
+
+    // The threads read the file at random positions
+    if (m_fStreaming || !m_fRandomAccess || m_len <= 0) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutexIndex);
+
+        m_indexRanges.clear();
+        for (__int64 start = 0; start < m_len; start += INDEX_RANGE_SIZE) {
+            IndexRange range;
+            range.start = range.scanned = start;
+            range.end = std::min(start + INDEX_RANGE_SIZE, m_len);
+            m_indexRanges.push_back(range);
+        }
+    }
+    m_nNextIndexRange = 0;
+
+    // The ranges are handed out in order so the index mostly grows from the beginning
+    size_t nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned)INDEX_THREADS));
+    nThreads = std::min(nThreads, m_indexRanges.size());
+    for (size_t i = 0; i < nThreads; i++) {
+        m_indexThreads.emplace_back([this] { IndexThread(); });
+    }
+
+    return true;
+}
+
+void CBaseSplitterFile::StopIndexBuilder()
+{
+    m_bStopIndex = true;
+    for (auto& thread : m_indexThreads) {
+        thread.join();
+    }
+    m_indexThreads.clear();
+    m_bStopIndex = false;
+}
+
+void CBaseSplitterFile::IndexThread()
+{
+    SetThreadName(DWORD(-1), "Splitter Index Thread");
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+
+    std::vector<BYTE> buff(INDEX_BLOCK_SIZE + INDEX_BLOCK_OVERLAP);
+    std::vector<IndexEntry> entries;
+
+    for (size_t i = 0; !m_bStopIndex && (i = m_nNextIndexRange++) < m_indexRanges.size();) {
+        IndexRange& range = m_indexRanges[i];
+
+        for (__int64 pos = range.start; !m_bStopIndex && pos < range.end;) {
+            size_t nScan = (size_t)std::min<__int64>(INDEX_BLOCK_SIZE, range.end - pos);
+            size_t nAvail = (size_t)std::min<__int64>(nScan + INDEX_BLOCK_OVERLAP, m_len - pos);
+
+            // The range is left incomplete on error, seeks will have to probe the file there
+            if (S_OK != m_pAsyncReader->SyncRead(pos, (long)nAvail, buff.data())) {
+                break;
+            }
+
+            entries.clear();
+            pos += std::max<size_t>(ScanIndexBlock(buff.data(), nScan, nAvail, pos, entries), 1);
+
+            std::lock_guard<std::mutex> lock(m_mutexIndex);
+            range.entries.insert(range.entries.end(), entries.begin(), entries.end());
+            range.scanned = std::min(pos, range.end);
+        }
+    }
+}
+
+bool CBaseSplitterFile::FindIndexEntry(REFERENCE_TIME rt, DWORD id, IndexEntry& entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutexIndex);
+
+    // The last sync point before rt can only be trusted if everything between
+    // it and the next one of the same stream was scanned
+    const IndexEntry* pPrev = nullptr;
+    bool fFromStart = true;
+
+    for (const auto& range : m_indexRanges) {
+        for (const auto& e : range.entries) {
+            if (e.id != id) {
+                continue;
+            }
+            if (e.rt <= rt) {
+                pPrev = &e;
+            } else if (pPrev || fFromStart) {
+                entry = pPrev ? *pPrev : e;
+                return true;
+            } else {
+                return false;
+            }
+        }
+
+        if (range.scanned < range.end) {
+            pPrev = nullptr;
+            fFromStart = false;
+        }
+    }
+
+    // rt is after the last sync point of the stream and the rest of the file was scanned
+    if (pPrev) {
+        entry = *pPrev;
+        return true;
+    }
+
+    return false;
+}
+
+bool CBaseSplitterFile::GetIndex(std::vector<IndexEntry>& entries)
+{
+    std::lock_guard<std::mutex> lock(m_mutexIndex);
+
+    if (m_indexRanges.empty()) {
+        return false;
+    }
+
+    entries.clear();
+    for (const auto& range : m_indexRanges) {
+        if (range.scanned < range.end) {
+            return false;
+        }
+        entries.insert(entries.end(), range.entries.begin(), range.entries.end());
+    }
+
+    return true;
+}
+
+void CBaseSplitterFile::SetIndex(const std::vector<IndexEntry>& entries)
+{
+    StopIndexBuilder();
+
+    IndexRange range;
+    range.start = 0;
+    range.end = range.scanned = m_len;
+    range.entries = entries;
+
+    std::lock_guard<std::mutex> lock(m_mutexIndex);
+    m_indexRanges.clear();
+    m_indexRanges.push_back(range);
+}
+
+bool CBaseSplitterFile::FillBitBuffer()
+{
+    // load as many whole bytes as the buffer can take at once
+    __int64 len = std::min<__int64>((64 - m_bitlen) >> 3, GetLength() - m_pos);
+    if (len <= 0) {
+        return false;
+    }
+
+    UINT64 data = 0;
+    if (S_OK != Read((BYTE*)&data, len)) {
+        return false;
+    }
+    data = _byteswap_uint64(data) >> (64 - 8 * len);
+
+    m_bitbuff = len < 8 ? (m_bitbuff << (8 * len)) | data : data;
+    m_bitlen += 8 * (int)len;
+
+    return true;
 }
 
 UINT64 CBaseSplitterFile::BitRead(int nBits, bool fPeek)
 {
     ASSERT(nBits >= 0 && nBits <= 64);
 
-    while (m_bitlen < nBits) {
-        m_bitbuff <<= 8;
-        if (S_OK != Read((BYTE*)&m_bitbuff, 1)) {
-            return 0;   // EOF? // ASSERT(0);
+    if (nBits == 0) {
+        return 0;
+    }
+
+    if (nBits > 56) {
+        // a partial byte might be left in the buffer, there might not be room for enough whole bytes
+        UINT64 bitbuff = m_bitbuff;
+        int bitlen = m_bitlen;
+        __int64 pos = m_pos;
+
+        UINT64 ret = BitRead(nBits - 32) << 32;
+        ret |= BitRead(32);
+
+        if (fPeek) {
+            m_bitbuff = bitbuff;
+            m_bitlen = bitlen;
+            m_pos = pos;
         }
-        m_bitlen += 8;
+
+        return ret;
+    }
+
+    if (m_bitlen < nBits && (!FillBitBuffer() || m_bitlen < nBits)) {
+        return 0;   // EOF? // ASSERT(0);
     }
 
     int bitlen = m_bitlen - nBits;
 
-    UINT64 ret;
-    // The shift to 64 bits can give incorrect results.
-    // "The behavior is undefined if the right operand is negative, or greater than or equal to the length in bits of the promoted left operand."
-    if (nBits == 64) {
-        ret = m_bitbuff;
-    } else {
-        ret = (m_bitbuff >> bitlen) & ((1ui64 << nBits) - 1);
-    }
+    UINT64 ret = (m_bitbuff >> bitlen) & ((1ui64 << nBits) - 1);
 
     if (!fPeek) {
         m_bitbuff &= ((1ui64 << bitlen) - 1);
@@ -225,12 +582,74 @@ HRESULT CBaseSplitterFile::ByteRead(BYTE* pData, __int64 len)
     return Read(pData, len);
 }
 
+const BYTE* CBaseSplitterFile::BorrowPointer(__int64 len)
+{
+    if (!m_pMappedFile) {
+        return nullptr;
+    }
+
+    __int64 pos = GetPos();
+    const BYTE* pData = m_pMappedFile->BorrowPointer(pos, (LONG)len);
+    if (pData) {
+        Seek(pos + len);
+    }
+
+    return pData;
+}
+
+void CBaseSplitterFile::ReturnPointer(const BYTE* pData)
+{
+    if (m_pMappedFile && pData) {
+        m_pMappedFile->ReturnPointer(pData);
+    }
+}
+
+static int CountLeadingZeros(UINT64 x)
+{
+    ASSERT(x);
+
+    DWORD i;
+#ifdef _WIN64
+    _BitScanReverse64(&i, x);
+    return 63 - i;
+#else
+    if (_BitScanReverse(&i, DWORD(x >> 32))) {
+        return 31 - i;
+    }
+    _BitScanReverse(&i, DWORD(x));
+    return 63 - i;
+#endif
+}
+
 UINT64 CBaseSplitterFile::UExpGolombRead()
 {
-    int n = -1;
-    for (BYTE b = 0; !b; n++) {
-        b = (BYTE)BitRead(1);
+    // count the leading zeros of the whole buffer at once instead of reading them bit by bit
+    int n = 0;
+    for (;;) {
+        if (m_bitlen == 0 && !FillBitBuffer()) {
+            return 0;
+        }
+
+        UINT64 bits = m_bitbuff << (64 - m_bitlen);
+        if (bits) {
+            int zeros = CountLeadingZeros(bits);
+            n += zeros;
+            m_bitlen -= zeros + 1; // the marker bit is consumed too
+            break;
+        }
+
+        n += m_bitlen;
+        m_bitlen = 0;
+
+        if (n >= 64) {
+            return 0; // broken stream
+        }
     }
+
+    if (n >= 64) {
+        return 0;
+    }
+
     return (1ui64 << n) - 1 + BitRead(n);
 }
 
@@ -23,31 +23,110 @@
 
 #include <atlcoll.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "AsyncReader.h"
 
 #define DEFAULT_CACHE_LENGTH 64*1024    // Beliyaal: Changed the default cache length to allow Bluray playback over network
 
 class CBaseSplitterFile
 {
+public:
+    struct IndexEntry {
+        REFERENCE_TIME rt;
+        __int64 fp;
+        DWORD id;
+    };
+
+private:
     CComPtr<IAsyncReader> m_pAsyncReader;
-    CAutoVectorPtr<BYTE> m_pCache;
-    __int64 m_cachepos, m_cachelen, m_cachetotal;
+    CComQIPtr<IMappedFile> m_pMappedFile;
+
+    // The cache is made of several windows of m_cachetotal bytes. When the file
+    // is read sequentially, a background thread fills the next windows in advance.
+    struct CacheWindow {
+        std::vector<BYTE> data;
+        __int64 pos = 0;
+        __int64 len = 0;
+        bool bLoading = false;
+        DWORD dwLastUse = 0;
+    };
+
+    static const int CACHE_WINDOWS = 8;
+    static const int READAHEAD_WINDOWS = 4;
+
+    std::vector<CacheWindow> m_cache;
+    __int64 m_cachetotal;
+    DWORD m_dwCacheUse;
+    __int64 m_lastReadEnd;  // end of the previous read, used to detect sequential reads
+    __int64 m_consumePos;   // windows between this position and the read-ahead range must be kept
+    __int64 m_readAheadPos; // -1 when not reading ahead
+    bool m_bStopReadAhead;
+    std::mutex m_mutexCache;
+    std::condition_variable m_cacheCV;
+    std::thread m_readAheadThread;
 
     bool m_fStreaming, m_fRandomAccess;
     __int64 m_pos, m_len;
 
     virtual HRESULT Read(BYTE* pData, __int64 len); // use ByteRead
 
+    CacheWindow* FindCacheWindow(__int64 pos);
+    CacheWindow* GetFreeCacheWindow(bool bReadAhead);
+    void RequestReadAhead(__int64 pos);
+    void StopReadAhead();
+    void ReadAheadThread();
+
+    // The index builder splits the file in ranges which are scanned by several threads.
+    // The entries of a range are published while it is being scanned.
+    struct IndexRange {
+        __int64 start, end;
+        __int64 scanned; // everything before this position was scanned
+        std::vector<IndexEntry> entries;
+    };
+
+    static const __int64 INDEX_RANGE_SIZE = 32 * 1024 * 1024;
+    static const int INDEX_BLOCK_SIZE = 1024 * 1024;
+    static const int INDEX_BLOCK_OVERLAP = 64 * 1024;
+    static const int INDEX_THREADS = 4;
+
+    std::vector<IndexRange> m_indexRanges;
+    std::atomic<size_t> m_nNextIndexRange;
+    std::atomic<bool> m_bStopIndex;
+    std::mutex m_mutexIndex;
+    std::vector<std::thread> m_indexThreads;
+
+    void IndexThread();
+
 protected:
+    // Bits which were read ahead in whole bytes, the m_bitlen lowest ones are
+    // valid. m_pos is past them, see GetPos.
     UINT64 m_bitbuff;
     int m_bitlen;
 
+    bool FillBitBuffer();
+
     virtual void OnComplete() {}
 
+    // Called from the index threads, pData holds nAvail bytes read at pos. The sync points
+    // starting in the first nScan bytes must be added to entries, the rest of the buffer
+    // is only there to complete them. Returns the offset where the scan has to resume.
+    virtual size_t ScanIndexBlock(const BYTE* /*pData*/, size_t nScan, size_t /*nAvail*/, __int64 /*pos*/, std::vector<IndexEntry>& /*entries*/) {
+        return nScan;
+    }
+
+    // Derived classes overriding ScanIndexBlock must stop the builder in their destructor.
+    bool StartIndexBuilder();
+    void StopIndexBuilder();
+
 public:
     CBaseSplitterFile(IAsyncReader* pReader, HRESULT& hr,
                       int cachelen = DEFAULT_CACHE_LENGTH,
                       bool fRandomAccess = true, bool fStreaming = false);
-    virtual ~CBaseSplitterFile() {}
+    virtual ~CBaseSplitterFile();
 
     bool SetCacheSize(int cachelen = DEFAULT_CACHE_LENGTH);
 
@@ -63,9 +142,24 @@ public:
     UINT64 BitRead(int nBits, bool fPeek = false);
     void BitByteAlign(), BitFlush();
     HRESULT ByteRead(BYTE* pData, __int64 len);
+    // Same as ByteRead but without any copy, only possible when the file is memory-mapped.
+    // Returns nullptr otherwise, the pointer must be given back with ReturnPointer.
+    // The data is read from the file when it is first accessed, an I/O error then raises
+    // EXCEPTION_IN_PAGE_ERROR instead of failing a read. Every access through the pointer
+    // has to be guarded by __try/__except, like CopyMappedData in AsyncReader.cpp does.
+    const BYTE* BorrowPointer(__int64 len);
+    void ReturnPointer(const BYTE* pData);
 
     bool IsStreaming() const { return m_fStreaming; }
     bool IsRandomAccess() const { return m_fRandomAccess; }
 
     HRESULT HasMoreData(__int64 len = 1, DWORD ms = 1);
+
+    // Finds the last sync point of the stream at or before rt, only succeeds
+    // when the index built so far is enough to be sure of it.
+    bool FindIndexEntry(REFERENCE_TIME rt, DWORD id, IndexEntry& entry);
+    // The entries are in file order, only available once the whole file was scanned
+    bool GetIndex(std::vector<IndexEntry>& entries);
+    // Replaces the scan by an index built earlier
+    void SetIndex(const std::vector<IndexEntry>& entries);
 };
@@ -154,6 +154,22 @@ UINT CMultiFiles::Read(void* lpBuf, UINT nCount)
     return dwRead;
 }
 
+UINT CMultiFiles::ReadAt(ULONGLONG llPosition, void* lpBuf, UINT nCount) const
+{
+    ASSERT(m_strFiles.GetCount() == 1);
+
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset = DWORD(llPosition);
+    overlapped.OffsetHigh = DWORD(llPosition >> 32);
+
+    DWORD dwRead = 0;
+    if (!ReadFile(m_hFile, lpBuf, nCount, &dwRead, &overlapped)) {
+        return 0;
+    }
+    return dwRead;
+}
+
 void CMultiFiles::Close()
 {
     ClosePart();
@@ -79,6 +79,9 @@ public:
     virtual ULONGLONG GetLength() const;
 
     virtual UINT Read(void* lpBuf, UINT nCount);
+    // Reads at the given position without using the file pointer, which makes it
+    // safe to call from several threads. Only available when a single file is open.
+    UINT ReadAt(ULONGLONG llPosition, void* lpBuf, UINT nCount) const;
     virtual void Close();
 
     // Implementation
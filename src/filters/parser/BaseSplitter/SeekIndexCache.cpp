@@ -0,0 +1,292 @@
+/*
+ * (C) 2014 see Authors.txt
+ *
+ * This file is part of MPC-HC.
+ *
+ * MPC-HC is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MPC-HC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <shlobj.h>
+#include "SeekIndexCache.h"
+
+namespace
+{
+    template<class T>
+    void Put(std::vector<BYTE>& buff, const T& value)
+    {
+        const BYTE* p = (const BYTE*)&value;
+        buff.insert(buff.end(), p, p + sizeof(value));
+    }
+
+    void PutEntries(std::vector<BYTE>& buff, const std::vector<CBaseSplitterFile::IndexEntry>& entries)
+    {
+        Put(buff, (DWORD)entries.size());
+        for (const auto& entry : entries) {
+            Put(buff, entry.rt);
+            Put(buff, entry.fp);
+            Put(buff, entry.id);
+        }
+    }
+
+    struct RecordReader {
+        const BYTE* p;
+        const BYTE* end;
+
+        size_t GetLeft() const {
+            return (size_t)(end - p);
+        }
+
+        bool Get(void* pData, size_t len) {
+            if (GetLeft() < len) {
+                return false;
+            }
+            memcpy(pData, p, len);
+            p += len;
+            return true;
+        }
+
+        template<class T>
+        bool Get(T& value) {
+            return Get(&value, sizeof(value));
+        }
+
+        bool GetEntries(std::vector<CBaseSplitterFile::IndexEntry>& entries) {
+            DWORD n;
+            if (!Get(n) || GetLeft() / (sizeof(REFERENCE_TIME) + sizeof(__int64) + sizeof(DWORD)) < n) {
+                return false;
+            }
+            entries.resize(n);
+            for (auto& entry : entries) {
+                Get(entry.rt);
+                Get(entry.fp);
+                Get(entry.id);
+            }
+            return true;
+        }
+    };
+
+    CCritSec s_csFolder;
+    CString s_folder;
+}
+
+//
+// CSeekIndexCache
+//
+
+void CSeekIndexCache::SetFolder(LPCTSTR pszFolder)
+{
+    CAutoLock cAutoLock(&s_csFolder);
+    s_folder = pszFolder;
+}
+
+bool CSeekIndexCache::GetFileId(LPCTSTR pszFileName, ULONGLONG llLength, FileId& id)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!pszFileName || !*pszFileName
+            || !GetFileAttributesEx(pszFileName, GetFileExInfoStandard, &fad)
+            || (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return false;
+    }
+
+    // FNV-1a hash of the path, paths are case insensitive
+    CString fn(pszFileName);
+    fn.MakeLower();
+    id.hash = 14695981039346656037ui64;
+    for (int i = 0; i < fn.GetLength(); i++) {
+        id.hash = (id.hash ^ (WORD)fn[i]) * 1099511628211ui64;
+    }
+
+    id.size = ((UINT64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+    id.ftLastWrite = fad.ftLastWriteTime;
+
+    return id.size == llLength;
+}
+
+CString CSeekIndexCache::GetCacheFolder(bool fCreate)
+{
+    CString path;
+    {
+        CAutoLock cAutoLock(&s_csFolder);
+        path = s_folder;
+    }
+
+    if (fCreate && !path.IsEmpty()) {
+        int ret = SHCreateDirectoryEx(nullptr, path, nullptr);
+        if (ret != ERROR_SUCCESS && ret != ERROR_ALREADY_EXISTS) {
+            return _T("");
+        }
+    }
+
+    return path;
+}
+
+CString CSeekIndexCache::GetRecordPath(LPCTSTR pszFolder, const FileId& id)
+{
+    CString path;
+    path.Format(_T("%s\\%016I64x.idx"), pszFolder, id.hash);
+    return path;
+}
+
+void CSeekIndexCache::Prune(LPCTSTR pszFolder)
+{
+    std::vector<std::pair<UINT64, CString>> records;
+
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile(CString(pszFolder) + _T("\\*.idx"), &fd);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        UINT64 time = ((UINT64)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime;
+        records.emplace_back(time, CString(fd.cFileName));
+    } while (FindNextFile(hFind, &fd));
+    FindClose(hFind);
+
+    if (records.size() <= MAX_RECORDS) {
+        return;
+    }
+
+    // the records which were written first go first
+    std::sort(records.begin(), records.end());
+    for (size_t i = 0, j = records.size() - MAX_RECORDS; i < j; i++) {
+        DeleteFile(CString(pszFolder) + _T("\\") + records[i].second);
+    }
+}
+
+bool CSeekIndexCache::Load(LPCTSTR pszFileName, ULONGLONG llLength, Record& record)
+{
+    FileId id;
+    CString folder = GetCacheFolder(false);
+    if (folder.IsEmpty() || !GetFileId(pszFileName, llLength, id)) {
+        return false;
+    }
+
+    std::vector<BYTE> buff;
+
+    try {
+        CFile file(GetRecordPath(folder, id), CFile::modeRead | CFile::shareDenyWrite);
+        ULONGLONG len = file.GetLength();
+        if (len > MAX_RECORD_SIZE) {
+            return false;
+        }
+        buff.resize((size_t)len);
+        if (file.Read(buff.data(), (UINT)len) != len) {
+            return false;
+        }
+    } catch (CException* e) {
+        // most likely there is no record for this file yet
+        e->Delete();
+        return false;
+    }
+
+    RecordReader r = {buff.data(), buff.data() + buff.size()};
+
+    DWORD magic, version;
+    FileId fid;
+    if (!r.Get(magic) || magic != MAGIC || !r.Get(version) || version != VERSION
+            || !r.Get(fid.hash) || !r.Get(fid.size) || !r.Get(fid.ftLastWrite)
+            || fid.hash != id.hash || fid.size != id.size || CompareFileTime(&fid.ftLastWrite, &id.ftLastWrite) != 0) {
+        return false;
+    }
+
+    record = Record();
+
+    DWORD nStreams;
+    if (!r.Get(record.rtFirst) || !r.Get(record.rtDuration) || !r.Get(nStreams)) {
+        return false;
+    }
+
+    for (; nStreams > 0; nStreams--) {
+        Stream s;
+        ULONG cbFormat;
+        if (!r.Get(s.id) || !r.Get(s.mt.majortype) || !r.Get(s.mt.subtype) || !r.Get(s.mt.formattype)
+                || !r.Get(s.mt.bFixedSizeSamples) || !r.Get(s.mt.bTemporalCompression) || !r.Get(s.mt.lSampleSize)
+                || !r.Get(cbFormat) || cbFormat > r.GetLeft()) {
+            return false;
+        }
+        if (cbFormat > 0) {
+            if (!s.mt.AllocFormatBuffer(cbFormat)) {
+                return false;
+            }
+            r.Get(s.mt.Format(), cbFormat);
+        }
+        record.streams.push_back(s);
+    }
+
+    return r.GetEntries(record.sps) && r.GetEntries(record.index);
+}
+
+bool CSeekIndexCache::Save(LPCTSTR pszFileName, ULONGLONG llLength, const Record& record)
+{
+    FileId id;
+    CString folder = GetCacheFolder(true);
+    if (folder.IsEmpty() || !GetFileId(pszFileName, llLength, id)) {
+        return false;
+    }
+
+    std::vector<BYTE> buff;
+
+    Put(buff, (DWORD)MAGIC);
+    Put(buff, (DWORD)VERSION);
+    Put(buff, id.hash);
+    Put(buff, id.size);
+    Put(buff, id.ftLastWrite);
+    Put(buff, record.rtFirst);
+    Put(buff, record.rtDuration);
+
+    Put(buff, (DWORD)record.streams.size());
+    for (const auto& s : record.streams) {
+        Put(buff, s.id);
+        Put(buff, s.mt.majortype);
+        Put(buff, s.mt.subtype);
+        Put(buff, s.mt.formattype);
+        Put(buff, s.mt.bFixedSizeSamples);
+        Put(buff, s.mt.bTemporalCompression);
+        Put(buff, s.mt.lSampleSize);
+        Put(buff, s.mt.cbFormat);
+        buff.insert(buff.end(), s.mt.pbFormat, s.mt.pbFormat + s.mt.cbFormat);
+    }
+
+    PutEntries(buff, record.sps);
+    PutEntries(buff, record.index);
+
+    if (buff.size() > MAX_RECORD_SIZE) {
+        return false;
+    }
+
+    // Another player could be reading or writing the same record, it is
+    // written under a temporary name first and then replaced at once.
+    CString path = GetRecordPath(folder, id), tmp;
+    tmp.Format(_T("%s.%lu.tmp"), path, GetCurrentThreadId());
+
+    try {
+        CFile file(tmp, CFile::modeCreate | CFile::modeWrite | CFile::shareExclusive);
+        file.Write(buff.data(), (UINT)buff.size());
+    } catch (CException* e) {
+        e->Delete();
+        DeleteFile(tmp);
+        return false;
+    }
+
+    if (!MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(tmp);
+        return false;
+    }
+
+    Prune(folder);
+
+    return true;
+}
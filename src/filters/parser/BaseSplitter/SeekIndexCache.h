@@ -0,0 +1,73 @@
+/*
+ * (C) 2014 see Authors.txt
+ *
+ * This file is part of MPC-HC.
+ *
+ * MPC-HC is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MPC-HC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include "BaseSplitterFile.h"
+
+// Keeps what the splitters found by scanning the files they opened, so it doesn't
+// have to be done again the next time. The records are stored in the folder given
+// to SetFolder and are only used if the size and the last write time of the file
+// didn't change. Nothing is cached until the host application chose a folder.
+class CSeekIndexCache
+{
+    static const DWORD MAGIC = 0x58444953; // "SIDX"
+    static const DWORD VERSION = 1;
+    static const size_t MAX_RECORDS = 256;
+    static const ULONGLONG MAX_RECORD_SIZE = 64 * 1024 * 1024;
+
+    struct FileId {
+        UINT64 hash;
+        UINT64 size;
+        FILETIME ftLastWrite;
+    };
+
+    static bool GetFileId(LPCTSTR pszFileName, ULONGLONG llLength, FileId& id);
+    static CString GetCacheFolder(bool fCreate);
+    static CString GetRecordPath(LPCTSTR pszFolder, const FileId& id);
+    static void Prune(LPCTSTR pszFolder);
+
+public:
+    struct Stream {
+        DWORD id;
+        CMediaType mt;
+    };
+
+    struct Record {
+        REFERENCE_TIME rtFirst;
+        REFERENCE_TIME rtDuration;
+        std::vector<Stream> streams;
+        // Positions where all the streams can start at once, the id isn't used
+        std::vector<CBaseSplitterFile::IndexEntry> sps;
+        // Sync points of each stream, see CBaseSplitterFile::GetIndex
+        std::vector<CBaseSplitterFile::IndexEntry> index;
+
+        Record() : rtFirst(0), rtDuration(0) {}
+    };
+
+    // An empty folder disables the cache, which is the default
+    static void SetFolder(LPCTSTR pszFolder);
+
+    // llLength is the length of the stream the splitter reads, the file is only
+    // cached if that is the whole file and not one part of a playlist
+    static bool Load(LPCTSTR pszFileName, ULONGLONG llLength, Record& record);
+    static bool Save(LPCTSTR pszFileName, ULONGLONG llLength, const Record& record);
+};
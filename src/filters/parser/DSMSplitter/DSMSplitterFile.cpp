@@ -21,11 +21,14 @@
 
 #include "stdafx.h"
 #include "DSMSplitterFile.h"
+#include "../BaseSplitter/SeekIndexCache.h"
 #include "../../../DSUtil/DSUtil.h"
 #include "moreuuids.h"
 
-CDSMSplitterFile::CDSMSplitterFile(IAsyncReader* pReader, HRESULT& hr, IDSMResourceBagImpl& res, IDSMChapterBagImpl& chap)
+CDSMSplitterFile::CDSMSplitterFile(IAsyncReader* pReader, HRESULT& hr, IDSMResourceBagImpl& res, IDSMChapterBagImpl& chap, LPCTSTR pszFileName)
     : CBaseSplitterFile(pReader, hr, DEFAULT_CACHE_LENGTH, false)
+    , m_fn(pszFileName)
+    , m_fCached(false)
     , m_rtFirst(0)
     , m_rtDuration(0)
 {
@@ -36,6 +39,13 @@ CDSMSplitterFile::CDSMSplitterFile(IAsyncReader* pReader, HRESULT& hr, IDSMResou
     hr = Init(res, chap);
 }
 
+CDSMSplitterFile::~CDSMSplitterFile()
+{
+    // ScanIndexBlock must not be called anymore once we are gone
+    StopIndexBuilder();
+    SaveCachedIndex();
+}
+
 HRESULT CDSMSplitterFile::Init(IDSMResourceBagImpl& res, IDSMChapterBagImpl& chap)
 {
     Seek(0);
@@ -95,7 +105,10 @@ HRESULT CDSMSplitterFile::Init(IDSMResourceBagImpl& res, IDSMChapterBagImpl& cha
         return E_FAIL;
     }
 
-    // ... and the end
+    // ... and the end, the resources and the chapters are usually stored there.
+    // The cached index replaces the syncpoints and the duration found there.
+
+    LoadCachedIndex();
 
     if (IsRandomAccess()) {
         int limit = MAX_PROBE_SIZE;
@@ -110,11 +123,15 @@ HRESULT CDSMSplitterFile::Init(IDSMResourceBagImpl& res, IDSMChapterBagImpl& cha
                 if (type == DSMP_SAMPLE) {
                     Packet p;
                     if (Read(len, &p, false) && p.rtStart != Packet::INVALID_TIME) {
-                        m_rtDuration = std::max(m_rtDuration, p.rtStop - m_rtFirst); // max isn't really needed, only for safety
+                        if (!m_fCached) {
+                            m_rtDuration = std::max(m_rtDuration, p.rtStop - m_rtFirst); // max isn't really needed, only for safety
+                        }
                         i = j;
                     }
                 } else if (type == DSMP_SYNCPOINTS) {
-                    Read(len, m_sps);
+                    if (!m_fCached) {
+                        Read(len, m_sps);
+                    }
                 } else if (type == DSMP_RESOURCE) {
                     Read(len, res);
                 } else if (type == DSMP_CHAPTERS) {
@@ -131,7 +148,81 @@ HRESULT CDSMSplitterFile::Init(IDSMResourceBagImpl& res, IDSMChapterBagImpl& cha
         m_rtFirst = 0;
     }
 
-    return !m_mts.IsEmpty() ? S_OK : E_FAIL;
+    if (m_mts.IsEmpty()) {
+        return E_FAIL;
+    }
+
+    // without the syncpoints table, seeking would have to probe the file each time
+    if (!m_fCached && m_sps.GetCount() <= 1 && m_rtDuration > 0) {
+        StartIndexBuilder();
+    }
+
+    return S_OK;
+}
+
+bool CDSMSplitterFile::LoadCachedIndex()
+{
+    CSeekIndexCache::Record record;
+    if (m_fn.IsEmpty() || !CSeekIndexCache::Load(m_fn, (ULONGLONG)GetLength(), record) || record.streams.size() != m_mts.GetCount()) {
+        return false;
+    }
+
+    // the media types were read from the header again, they must not have changed
+    for (const auto& s : record.streams) {
+        const CAtlMap<BYTE, CMediaType>::CPair* pPair = m_mts.Lookup((BYTE)s.id);
+        if (!pPair || pPair->m_value != s.mt) {
+            return false;
+        }
+    }
+
+    m_rtFirst = record.rtFirst;
+    m_rtDuration = record.rtDuration;
+
+    m_sps.RemoveAll();
+    for (const auto& entry : record.sps) {
+        SyncPoint sp = {entry.rt, entry.fp};
+        m_sps.Add(sp);
+    }
+
+    if (!record.index.empty()) {
+        SetIndex(record.index);
+    }
+
+    m_fCached = true;
+    return true;
+}
+
+void CDSMSplitterFile::SaveCachedIndex()
+{
+    if (m_fn.IsEmpty() || m_fCached || m_mts.IsEmpty()) {
+        return;
+    }
+
+    CSeekIndexCache::Record record;
+
+    // nothing worth keeping if the file has no syncpoints table and wasn't indexed completely
+    if (!GetIndex(record.index) && m_sps.GetCount() <= 1) {
+        return;
+    }
+
+    record.rtFirst = m_rtFirst;
+    record.rtDuration = m_rtDuration;
+
+    POSITION pos = m_mts.GetStartPosition();
+    while (pos) {
+        CSeekIndexCache::Stream s;
+        BYTE id;
+        m_mts.GetNextAssoc(pos, id, s.mt);
+        s.id = id;
+        record.streams.push_back(s);
+    }
+
+    for (size_t i = 0; i < m_sps.GetCount(); i++) {
+        IndexEntry entry = {m_sps[i].rt, m_sps[i].fp, 0};
+        record.sps.push_back(entry);
+    }
+
+    CSeekIndexCache::Save(m_fn, (ULONGLONG)GetLength(), record);
 }
 
 bool CDSMSplitterFile::Sync(dsmp_t& type, UINT64& len, __int64 limit)
@@ -159,6 +250,68 @@ bool CDSMSplitterFile::Sync(UINT64& syncpos, dsmp_t& type, UINT64& len, __int64
     return true;
 }
 
+size_t CDSMSplitterFile::ScanIndexBlock(const BYTE* pData, size_t nScan, size_t nAvail, __int64 pos, std::vector<IndexEntry>& entries)
+{
+    auto readBytes = [pData](size_t& i, int n) -> UINT64 {
+        UINT64 v = 0;
+        while (n-- > 0) {
+            v = (v << 8) | pData[i++];
+        }
+        return v;
+    };
+
+    size_t i = 0;
+
+    while (i < nScan) {
+        size_t j = i;
+        if (j + DSMSW_SIZE + 1 > nAvail || readBytes(j, DSMSW_SIZE) != DSMSW) {
+            i++;
+            continue;
+        }
+
+        dsmp_t type = (dsmp_t)(pData[j] >> 3);
+        int iLength = (pData[j++] & 7) + 1;
+        if (j + iLength > nAvail) {
+            i++;
+            continue;
+        }
+        UINT64 len = readBytes(j, iLength);
+        if (len > (UINT64)(GetLength() - pos - j)) {
+            i++;
+            continue;
+        }
+        UINT64 next = j + len;
+
+        // a sync word found in the middle of some data would make us skip real packets,
+        // make sure another packet follows this one
+        if (next + DSMSW_SIZE <= nAvail) {
+            size_t k = (size_t)next;
+            if (readBytes(k, DSMSW_SIZE) != DSMSW) {
+                i++;
+                continue;
+            }
+        }
+
+        if (type == DSMP_SAMPLE && len >= 2 && j + 2 <= nAvail) {
+            BYTE id = pData[j];
+            bool fSyncPoint = !!(pData[j + 1] & 0x80);
+            bool fSign = !!(pData[j + 1] & 0x40);
+            int iTimeStamp = (pData[j + 1] >> 3) & 7;
+            j += 2;
+
+            if (fSyncPoint && !(fSign && !iTimeStamp) && j + iTimeStamp <= nAvail) {
+                REFERENCE_TIME rt = (REFERENCE_TIME)readBytes(j, iTimeStamp) * (fSign ? -1 : 1);
+                IndexEntry entry = {rt, pos + (__int64)i, id};
+                entries.push_back(entry);
+            }
+        }
+
+        i = (size_t)next;
+    }
+
+    return i;
+}
+
 bool CDSMSplitterFile::Read(__int64 len, BYTE& id, CMediaType& mt)
 {
     id = (BYTE)BitRead(8);
@@ -317,6 +470,42 @@ __int64 CDSMSplitterFile::FindSyncPoint(REFERENCE_TIME rt)
         return 0;
     }
 
+    // every stream needs a syncpoint, except for subtitle streams
+
+    CAtlMap<BYTE, BYTE> ids;
+
+    {
+        POSITION pos = m_mts.GetStartPosition();
+        while (pos) {
+            BYTE id;
+            CMediaType mt;
+            m_mts.GetNextAssoc(pos, id, mt);
+            if (mt.majortype != MEDIATYPE_Text && mt.majortype != MEDIATYPE_Subtitle) {
+                ids[id] = 0;
+            }
+        }
+    }
+
+    // the index built in the background may already know about this part of the file
+
+    if (!ids.IsEmpty()) {
+        __int64 ret = GetLength();
+
+        POSITION pos = ids.GetStartPosition();
+        while (pos) {
+            IndexEntry entry;
+            if (!FindIndexEntry(m_rtFirst + rt, ids.GetNextKey(pos), entry)) {
+                ret = -1;
+                break;
+            }
+            ret = std::min(ret, entry.fp);
+        }
+
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+
     // ok, do the hard way then
 
     dsmp_t type;
@@ -380,20 +569,6 @@ __int64 CDSMSplitterFile::FindSyncPoint(REFERENCE_TIME rt)
 
     // 3. iterate backwards from maxpos and find at least one syncpoint for every stream, except for subtitle streams
 
-    CAtlMap<BYTE, BYTE> ids;
-
-    {
-        POSITION pos = m_mts.GetStartPosition();
-        while (pos) {
-            BYTE id;
-            CMediaType mt;
-            m_mts.GetNextAssoc(pos, id, mt);
-            if (mt.majortype != MEDIATYPE_Text && mt.majortype != MEDIATYPE_Subtitle) {
-                ids[id] = 0;
-            }
-        }
-    }
-
     __int64 ret = maxpos;
 
     while (maxpos > 0 && !ids.IsEmpty()) {
@@ -30,10 +30,19 @@
 
 class CDSMSplitterFile : public CBaseSplitterFile
 {
+    CString m_fn;
+    bool m_fCached;
+
     HRESULT Init(IDSMResourceBagImpl& res, IDSMChapterBagImpl& chap);
+    bool LoadCachedIndex();
+    void SaveCachedIndex();
+
+protected:
+    size_t ScanIndexBlock(const BYTE* pData, size_t nScan, size_t nAvail, __int64 pos, std::vector<IndexEntry>& entries);
 
 public:
-    CDSMSplitterFile(IAsyncReader* pReader, HRESULT& hr, IDSMResourceBagImpl& res, IDSMChapterBagImpl& chap);
+    CDSMSplitterFile(IAsyncReader* pReader, HRESULT& hr, IDSMResourceBagImpl& res, IDSMChapterBagImpl& chap, LPCTSTR pszFileName = nullptr);
+    ~CDSMSplitterFile();
 
     CAtlMap<BYTE, CMediaType> m_mts;
     REFERENCE_TIME m_rtFirst, m_rtDuration;
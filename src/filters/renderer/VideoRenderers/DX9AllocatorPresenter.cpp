@@ -1960,6 +1960,24 @@ void CDX9AllocatorPresenter::DrawStats()
                            nFree, nAlloc, nSubPic, (double(rtQueueStart) / 10000000.0), (double(rtQueueEnd) / 10000000.0));
             DrawText(rc, strText, 1);
             OffsetRect(&rc, 0, TextHeight);
+
+            CComQIPtr<ISubPicQueueTelemetry> pSubPicQueueTelemetry = m_pSubPicQueue;
+            SubPicQueueTelemetry telemetry;
+            if (pSubPicQueueTelemetry && SUCCEEDED(pSubPicQueueTelemetry->GetTelemetry(telemetry))) {
+                strText.Format(L"Sub. queue   : Rendered %I64u   Presented %I64u   Dropped %I64u   Invalidated %I64u   Merged %I64u   Misses %I64u/%I64u   Waits %I64u",
+                               telemetry.nRendered, telemetry.nPresented, telemetry.nDropped, telemetry.nInvalidated, telemetry.nMerged,
+                               telemetry.nLookupMisses, telemetry.nLookups, telemetry.nBlockingWaits);
+                DrawText(rc, strText, 1);
+                OffsetRect(&rc, 0, TextHeight);
+
+                strText.Format(L"Sub. timings : Render %7.3f ms (max %7.3f)   Queued %7.3f ms   Wait %7.3f ms (max %7.3f)   Lock %7.3f ms (max %7.3f)",
+                               double(telemetry.renderDuration.GetAverage()) / 10000.0, double(telemetry.renderDuration.rtMax) / 10000.0,
+                               double(telemetry.queueLatency.GetAverage()) / 10000.0,
+                               double(telemetry.blockingWait.GetAverage()) / 10000.0, double(telemetry.blockingWait.rtMax) / 10000.0,
+                               double(telemetry.providerLockWait.GetAverage()) / 10000.0, double(telemetry.providerLockWait.rtMax) / 10000.0);
+                DrawText(rc, strText, 1);
+                OffsetRect(&rc, 0, TextHeight);
+            }
         }
 
         if (iDetailedStats > 1) {
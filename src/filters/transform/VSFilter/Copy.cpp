@@ -202,6 +202,18 @@ void CDirectVobSubFilter::PrintMessages(BYTE* pOut)
             m_pSubPicQueue->GetStats(i, rtStart, rtStop);
             msg.AppendFormat(_T("%d: %I64d - %I64d [ms]\n"), i, rtStart / 10000, rtStop / 10000);
         }
+
+        CComQIPtr<ISubPicQueueTelemetry> pSubPicQueueTelemetry = m_pSubPicQueue;
+        SubPicQueueTelemetry telemetry;
+        if (pSubPicQueueTelemetry && SUCCEEDED(pSubPicQueueTelemetry->GetTelemetry(telemetry))) {
+            msg.AppendFormat(_T("rendered: %I64u, presented: %I64u, dropped: %I64u, merged: %I64u, misses: %I64u, waits: %I64u\n"),
+                             telemetry.nRendered, telemetry.nPresented, telemetry.nDropped, telemetry.nMerged, telemetry.nLookupMisses, telemetry.nBlockingWaits);
+            msg.Append(_T("render time histogram:"));
+            for (int i = 0; i < SubPicQueueHistogram::BUCKETS; i++) {
+                msg.AppendFormat(_T(" %I64u"), telemetry.renderDuration.buckets[i]);
+            }
+            msg.Append(_T("\n"));
+        }
     }
 
     HANDLE hOldBitmap = SelectObject(m_hdc, m_hbm);
@@ -37,6 +37,7 @@ CDirectVobSub::CDirectVobSub()
     m_subPicQueueSettings.nRenderAtWhenAnimationIsDisabled = theApp.GetProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_RENDERATWITHOUTANIM), 50);
     m_subPicQueueSettings.nAnimationRate = theApp.GetProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_ANIMATIONRATE), 100);
     m_subPicQueueSettings.bAllowDroppingSubpic = !!theApp.GetProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_ALLOWDROPPINGSUBPIC), TRUE);
+    m_subPicQueueSettings.bCompressQueuedSubpics = !!theApp.GetProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_COMPRESSQUEUEDSUBPICS), FALSE);
     m_fOverridePlacement = !!theApp.GetProfileInt(ResStr(IDS_R_TEXT), ResStr(IDS_RT_OVERRIDEPLACEMENT), FALSE);
     m_PlacementXperc = theApp.GetProfileInt(ResStr(IDS_R_TEXT), ResStr(IDS_RT_XPERC), 50);
     m_PlacementYperc = theApp.GetProfileInt(ResStr(IDS_R_TEXT), ResStr(IDS_RT_YPERC), 90);
@@ -530,6 +531,7 @@ STDMETHODIMP CDirectVobSub::UpdateRegistry()
     theApp.WriteProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_RENDERATWITHOUTANIM), m_subPicQueueSettings.nRenderAtWhenAnimationIsDisabled);
     theApp.WriteProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_ANIMATIONRATE), m_subPicQueueSettings.nAnimationRate);
     theApp.WriteProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_ALLOWDROPPINGSUBPIC), m_subPicQueueSettings.bAllowDroppingSubpic);
+    theApp.WriteProfileInt(ResStr(IDS_R_GENERAL), ResStr(IDS_RG_COMPRESSQUEUEDSUBPICS), m_subPicQueueSettings.bCompressQueuedSubpics);
     theApp.WriteProfileInt(ResStr(IDS_R_TEXT), ResStr(IDS_RT_OVERRIDEPLACEMENT), m_fOverridePlacement);
     theApp.WriteProfileInt(ResStr(IDS_R_TEXT), ResStr(IDS_RT_XPERC), m_PlacementXperc);
     theApp.WriteProfileInt(ResStr(IDS_R_TEXT), ResStr(IDS_RT_YPERC), m_PlacementYperc);
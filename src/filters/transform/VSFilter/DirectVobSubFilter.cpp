@@ -559,7 +559,9 @@ void CDirectVobSubFilter::InitSubPicQueue()
     m_spd.pitch = m_spd.w * m_spd.bpp >> 3;
     m_spd.bits = m_pTempPicBuff;
 
-    CComPtr<ISubPicAllocator> pSubPicAllocator = DEBUG_NEW CMemSubPicAllocator(m_spd.type, CSize(m_w, m_h));
+    // Only the threaded queue keeps subpics around long enough for the compression to pay off
+    bool bCompressDynamic = m_subPicQueueSettings.nSize > 0 && m_subPicQueueSettings.bCompressQueuedSubpics;
+    CComPtr<ISubPicAllocator> pSubPicAllocator = DEBUG_NEW CMemSubPicAllocator(m_spd.type, CSize(m_w, m_h), bCompressDynamic);
 
     CSize video(bihIn.biWidth, bihIn.biHeight), window = video;
     if (AdjustFrameSize(window)) {
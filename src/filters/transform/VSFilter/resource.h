@@ -85,6 +85,7 @@
 #define IDS_RG_RENDERATWITHOUTANIM      181
 #define IDS_RG_ANIMATIONRATE            182
 #define IDS_RG_ALLOWDROPPINGSUBPIC      183
+#define IDS_RG_COMPRESSQUEUEDSUBPICS    184
 #define IDC_FILENAME                    201
 #define IDD_DVSMAINPAGE                 201
 #define IDC_OPEN                        202
@@ -154,6 +154,8 @@ CAppSettings::CAppSettings()
     , nJumpDistL(DEFAULT_JUMPDISTANCE_3)
     , bFastSeek(true)
     , eFastSeekMethod(FASTSEEK_NEAREST_KEYFRAME)
+    , bSeekIndexCache(true)
+    , iSplitterBufferDuration(0)
     , fShowChapters(true)
     , bNotifySkype(false)
     , fPreventMinimize(false)
@@ -862,6 +864,8 @@ void CAppSettings::SaveSettings()
     pApp->WriteProfileInt(IDS_R_SETTINGS, IDS_RS_LANGUAGE, language);
     pApp->WriteProfileInt(IDS_R_SETTINGS, IDS_RS_FASTSEEK, bFastSeek);
     pApp->WriteProfileInt(IDS_R_SETTINGS, IDS_RS_FASTSEEK_METHOD, eFastSeekMethod);
+    pApp->WriteProfileInt(IDS_R_SETTINGS, IDS_RS_SEEK_INDEX_CACHE, bSeekIndexCache);
+    pApp->WriteProfileInt(IDS_R_SETTINGS, IDS_RS_SPLITTER_BUFFER_DURATION, iSplitterBufferDuration);
     pApp->WriteProfileInt(IDS_R_SETTINGS, IDS_RS_SHOW_CHAPTERS, fShowChapters);
 
 
@@ -1691,6 +1695,8 @@ void CAppSettings::LoadSettings()
     bFastSeek             = !!pApp->GetProfileInt(IDS_R_SETTINGS, IDS_RS_FASTSEEK, TRUE);
     eFastSeekMethod       = static_cast<decltype(eFastSeekMethod)>(
                                 pApp->GetProfileInt(IDS_R_SETTINGS, IDS_RS_FASTSEEK_METHOD, FASTSEEK_NEAREST_KEYFRAME));
+    bSeekIndexCache       = !!pApp->GetProfileInt(IDS_R_SETTINGS, IDS_RS_SEEK_INDEX_CACHE, TRUE);
+    iSplitterBufferDuration = std::max(0, (int)pApp->GetProfileInt(IDS_R_SETTINGS, IDS_RS_SPLITTER_BUFFER_DURATION, 0));
     fShowChapters         = !!pApp->GetProfileInt(IDS_R_SETTINGS, IDS_RS_SHOW_CHAPTERS, TRUE);
 
 
@@ -592,6 +592,8 @@ public:
     int             nJumpDistL;
     bool            bFastSeek;
     enum { FASTSEEK_LATEST_KEYFRAME, FASTSEEK_NEAREST_KEYFRAME } eFastSeekMethod;
+    bool            bSeekIndexCache;
+    int             iSplitterBufferDuration; // in ms, 0 lets the splitters choose
     bool            fShowChapters;
     bool            bNotifySkype;
     bool            fPreventMinimize;
@@ -27,6 +27,7 @@
 #include "FileVersionInfo.h"
 #include "PathUtils.h"
 #include "../filters/Filters.h"
+#include "../filters/parser/BaseSplitter/SeekIndexCache.h"
 #include "AllocatorCommon7.h"
 #include "AllocatorCommon.h"
 #include "SyncAllocatorPresenter.h"
@@ -40,6 +41,7 @@
 #include <evr9.h>
 #include <ksproxy.h>
 #include "IPinHook.h"
+#include "IBufferControl.h"
 #include "moreuuids.h"
 #include <mvrInterfaces.h>
 #include "../thirdparty/sanear/sanear/src/Factory.h"
@@ -1365,6 +1367,15 @@ CFGManagerCustom::CFGManagerCustom(LPCTSTR pName, LPUNKNOWN pUnk)
     // Reset LAVFilters internal instances
     CFGFilterLAV::ResetInternalInstances();
 
+    // The internal splitters keep the seek indexes they built next to the other files we save
+    CString seekIndexFolder;
+    if (s.bSeekIndexCache && AfxGetMyApp()->GetAppSavePath(seekIndexFolder)) {
+        seekIndexFolder = PathUtils::CombinePaths(seekIndexFolder, _T("SeekIndex"));
+    } else {
+        seekIndexFolder.Empty();
+    }
+    CSeekIndexCache::SetFolder(seekIndexFolder);
+
     // Prepare LAVFilters wrappers
     CAutoPtr<CFGFilterLAVSplitterBase> pFGLAVSplitterSource(static_cast<CFGFilterLAVSplitterBase*>(CFGFilterLAV::CreateFilter(CFGFilterLAV::SPLITTER_SOURCE)));
     CAutoPtr<CFGFilterLAVSplitterBase> pFGLAVSplitter(static_cast<CFGFilterLAVSplitterBase*>(CFGFilterLAV::CreateFilter(CFGFilterLAV::SPLITTER, MERIT64_ABOVE_DSHOW)));
@@ -2323,6 +2334,10 @@ STDMETHODIMP CFGManagerCustom::AddFilter(IBaseFilter* pBF, LPCWSTR pName)
         pASF->SetNormalizeBoost2(s.fAudioNormalize, s.nAudioMaxNormFactor, s.fAudioNormalizeRecover, s.nAudioBoost);
     }
 
+    if (CComQIPtr<IBufferControl> pBC = pBF) {
+        pBC->SetBufferDuration(10000i64 * s.iSplitterBufferDuration);
+    }
+
     return hr;
 }
 
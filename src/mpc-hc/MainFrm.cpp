@@ -1988,6 +1988,10 @@ void CMainFrame::OnTimer(UINT_PTR nIDEvent)
                 }
 
                 if (!sInfo.IsEmpty()) {
+                    int blocks, size, hitRate;
+                    if (m_pBPI && S_OK == m_pBPI->GetPoolStatus(blocks, size, hitRate)) {
+                        sInfo.AppendFormat(_T("pool: %d/%d KB %d%% "), blocks, size / 1024, hitRate);
+                    }
                     sInfo.AppendFormat(_T("(p%lu)"), m_pBI->GetPriority());
                     m_wndStatsBar.SetLine(ResStr(IDS_AG_BUFFERS), sInfo);
                 }
@@ -11481,6 +11485,8 @@ void CMainFrame::OpenSetupStatsBar()
             m_wndStatsBar.SetLine(ResStr(IDS_STATSBAR_SIGNAL), info);
         }
         if (m_pBI) {
+            // the pool status is only available from our own splitters
+            m_pBPI = m_pBI;
             m_wndStatsBar.SetLine(ResStr(IDS_AG_BUFFERS), info);
         }
         if (bFoundIBitRateInfo) {
@@ -12150,6 +12156,7 @@ void CMainFrame::CloseMediaPrivate()
     m_pDVDI.Release();
     m_pAMOP.Release();
     m_pBI.Release();
+    m_pBPI.Release();
     m_pQP.Release();
     m_pFS.Release();
     m_pMS.Release();
@@ -56,6 +56,7 @@
 #include "IChapterInfo.h"
 #include "IKeyFrameInfo.h"
 #include "IBufferInfo.h"
+#include "IBufferPoolInfo.h"
 
 #include "WebServer.h"
 #include <afxmt.h>
@@ -241,6 +242,7 @@ private:
     CComQIPtr<IKeyFrameInfo> m_pKFI;
     CComQIPtr<IQualProp, &IID_IQualProp> m_pQP;
     CComQIPtr<IBufferInfo> m_pBI;
+    CComQIPtr<IBufferPoolInfo> m_pBPI;
     CComQIPtr<IAMOpenProgress> m_pAMOP;
     CComPtr<IVMRMixerControl9> m_pVMRMC;
     CComPtr<IMFVideoDisplayControl> m_pMFVDC;
@@ -256,6 +256,8 @@
 
 #define IDS_RS_FASTSEEK                     _T("FastSeek")
 #define IDS_RS_FASTSEEK_METHOD              _T("FastSeekMethod")
+#define IDS_RS_SEEK_INDEX_CACHE             _T("SeekIndexCache")
+#define IDS_RS_SPLITTER_BUFFER_DURATION     _T("SplitterBufferDuration")
 #define IDS_RS_SHOW_CHAPTERS                _T("ShowChapters")
 
 #define IDS_RS_LCD_SUPPORT                  _T("LcdSupport")